@@ -0,0 +1,4161 @@
+#include <iostream>
+#include <vector>
+#include <fstream>
+#include <cmath>
+#include <string>
+#include <algorithm>
+#include <sstream>
+#include <functional>
+#include <cstdlib>
+#include <thread>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <cstdio>
+#include <cerrno>
+#include <chrono>
+#ifdef __linux__
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+#include "image_processing.h"
+using namespace std;
+
+namespace image_processing
+{
+
+/**
+ * Gets an integer from a binary stream.
+ * Helper function for read_image()
+ * @param stream the stream
+ * @param offset the offset at which to read the integer
+ * @param bytes  the number of bytes to read
+ * @return the integer starting at the given offset
+ */
+static int get_int(fstream &stream, int offset, int bytes)
+{
+    stream.seekg(offset);
+    unsigned int result = 0; // Unsigned, so a four-byte value with its top bit set wraps instead of overflowing
+    for (int i = 0; i < bytes; i++)
+    {
+        result = result | static_cast<unsigned int>(stream.get() & 0xFF) << (8 * i);
+    }
+    return static_cast<int>(result);
+}
+
+/**
+ * Gets a little-endian integer from a block of bytes.
+ * Helper function for parse_bmp_info()
+ * @param bytes  the bytes
+ * @param offset the offset at which to read the integer
+ * @param count  the number of bytes to read
+ * @return the integer starting at the given offset
+ */
+static int get_int(const unsigned char bytes[], int offset, int count)
+{
+    int result = 0;
+    for (int i = count - 1; i >= 0; i--)
+    {
+        result = result * 256 + bytes[offset + i];
+    }
+    return result;
+}
+
+// Bytes of the BMP header and BITMAPINFOHEADER that hold the fields of BmpInfo
+const int BMP_INFO_BYTES = 54;
+
+/**
+ * Parses the BMP header fields from the first bytes of an image.
+ * Helper function for the image readers
+ * @param header the first BMP_INFO_BYTES bytes of the image
+ * @param info   the header fields, filled in place
+ * @return true if the header describes a valid image of 1, 4, 8, 24 or 32
+ *         bits per pixel, run-length encoded only at 4 or 8
+ */
+bool parse_bmp_info(const unsigned char header[], BmpInfo &info)
+{
+    info.file_size = get_int(header, 2, 4);
+    info.start = get_int(header, 10, 4);
+    info.width = get_int(header, 18, 4);
+    info.height = get_int(header, 22, 4);
+    info.bits_per_pixel = get_int(header, 28, 2);
+    info.compression = get_int(header, 30, 4);
+    info.colors = get_int(header, 46, 4);
+
+    // Scan lines must occupy multiples of four bytes
+    info.row_bytes = ((info.width * info.bits_per_pixel + 31) / 32) * 4;
+
+    if (info.bits_per_pixel == 1 || info.bits_per_pixel == 4 || info.bits_per_pixel == 8)
+    {
+        // A palette size of 0 means the full 2^bits_per_pixel entries
+        if (info.colors == 0 || info.colors > (1 << info.bits_per_pixel))
+        {
+            info.colors = 1 << info.bits_per_pixel;
+        }
+
+        // Run-length encoded pixel arrays have no fixed size
+        if ((info.compression == 1 && info.bits_per_pixel == 8) || (info.compression == 2 && info.bits_per_pixel == 4))
+        {
+            return info.width > 0 && info.height > 0 && info.file_size > info.start;
+        }
+        if (info.compression != 0)
+        {
+            return false;
+        }
+    }
+    else if (info.bits_per_pixel != 24 && info.bits_per_pixel != 32)
+    {
+        // Only the depths the decoders handle; 0 or 16 would pass the size check below
+        return false;
+    }
+
+    return info.width > 0 && info.height > 0 && info.file_size == info.start + info.row_bytes * info.height;
+}
+
+/**
+ * Reads the BMP header fields of an open image.
+ * Helper function for the image readers
+ * @param stream the stream
+ * @param info   the header fields, filled in place
+ * @return true if the header describes a valid image
+ */
+bool read_bmp_info(fstream &stream, BmpInfo &info)
+{
+    unsigned char header[BMP_INFO_BYTES];
+    stream.seekg(0);
+    stream.read((char *)header, BMP_INFO_BYTES);
+    return stream.gcount() == BMP_INFO_BYTES && parse_bmp_info(header, info);
+}
+
+/**
+ * Decodes the palette and pixel array of a 1, 4 or 8 bits per pixel image.
+ * Helper function for the palettized image readers
+ * @param info    the header fields of the image
+ * @param palette the palette as stored in the file
+ * @param data    the pixel array as stored in the file
+ * @param indexed the palette and indices, filled in place
+ */
+static void decode_indexed(const BmpInfo &info, const vector<unsigned char> &palette, const vector<unsigned char> &data,
+                           IndexedImage &indexed)
+{
+    // Palette entries are blue, green, red, reserved
+    indexed.palette.resize(info.colors);
+    for (int i = 0; i < info.colors; i++)
+    {
+        indexed.palette[i] = {palette[i * 4 + 2], palette[i * 4 + 1], palette[i * 4]};
+    }
+
+    int width = info.width;
+    int height = info.height;
+    indexed.indices.assign(height, vector<unsigned char>(width, 0));
+
+    if (info.compression == 0)
+    {
+        // BMP files store rows from bottom to top, leftmost pixel in the most significant bits
+        int bits = info.bits_per_pixel;
+        int pixels_per_byte = 8 / bits;
+        for (int i = 0; i < height; i++)
+        {
+            const unsigned char *row = &data[static_cast<size_t>(height - 1 - i) * info.row_bytes];
+            for (int j = 0; j < width; j++)
+            {
+                int shift = (pixels_per_byte - 1 - j % pixels_per_byte) * bits;
+                indexed.indices[i][j] = (row[j / pixels_per_byte] >> shift) & ((1 << bits) - 1);
+            }
+        }
+    }
+    else
+    {
+        // Run-length encoded: (count, index) runs, or 0 followed by an escape code
+        bool rle4 = info.compression == 2;
+        int x = 0;
+        int y = 0; // Rows counted from the bottom
+        size_t pos = 0;
+        while (pos + 1 < data.size() && y < height)
+        {
+            int count = data[pos];
+            int value = data[pos + 1];
+            pos += 2;
+
+            if (count > 0)
+            {
+                // Encoded mode; BI_RLE4 alternates between the two nibbles
+                for (int i = 0; i < count && x < width; i++, x++)
+                {
+                    indexed.indices[height - 1 - y][x] = rle4 ? (i % 2 == 0 ? value >> 4 : value & 15) : value;
+                }
+            }
+            else if (value == 0)
+            {
+                // End of line
+                x = 0;
+                y++;
+            }
+            else if (value == 1)
+            {
+                // End of bitmap
+                break;
+            }
+            else if (value == 2)
+            {
+                // Delta: skip right and up, leaving index 0
+                if (pos + 1 >= data.size())
+                {
+                    break;
+                }
+                x += data[pos];
+                y += data[pos + 1];
+                pos += 2;
+            }
+            else
+            {
+                // Absolute mode: value indices, padded to a 16-bit boundary
+                size_t bytes = rle4 ? (value + 1) / 2 : value;
+                for (int i = 0; i < value && pos + i / (rle4 ? 2 : 1) < data.size(); i++, x++)
+                {
+                    unsigned char byte = data[pos + (rle4 ? i / 2 : i)];
+                    if (x < width)
+                    {
+                        indexed.indices[height - 1 - y][x] = rle4 ? (i % 2 == 0 ? byte >> 4 : byte & 15) : byte;
+                    }
+                }
+                pos += bytes + bytes % 2;
+            }
+        }
+    }
+
+    // Indices beyond the end of the palette are read as the first entry
+    for (auto &row : indexed.indices)
+    {
+        for (auto &index : row)
+        {
+            if (index >= info.colors)
+            {
+                index = 0;
+            }
+        }
+    }
+}
+
+/**
+ * Reads a 1, 4 or 8 bits per pixel BMP image without expanding it to pixels.
+ * Uncompressed, BI_RLE8 and BI_RLE4 pixel arrays are supported.
+ * @param filename BMP image filename
+ * @param indexed  the palette and indices, filled in place
+ * @return false if the file is not a valid palettized image, or is shorter
+ *         than its uncompressed pixel array
+ */
+bool read_indexed_image(string filename, IndexedImage &indexed)
+{
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+
+    BmpInfo info;
+    if (!read_bmp_info(stream, info) || info.bits_per_pixel > 8)
+    {
+        return false;
+    }
+
+    // The palette follows the DIB header
+    int dib_header_size = get_int(stream, 14, 4);
+    vector<unsigned char> palette(info.colors * 4);
+    stream.seekg(14 + dib_header_size);
+    stream.read((char *)palette.data(), palette.size());
+
+    // The sizes in the header are not trusted for the allocation; a crafted one
+    // could ask for gigabytes, so the pixel array is capped by the file's length
+    stream.seekg(0, ios::end);
+    long long available = static_cast<long long>(stream.tellg()) - info.start;
+    long long size = min<long long>(info.file_size - info.start, available);
+    if (size <= 0 || (info.compression == 0 && size < static_cast<long long>(info.row_bytes) * info.height))
+    {
+        return false;
+    }
+    vector<unsigned char> data(size);
+    stream.seekg(info.start);
+    stream.read((char *)data.data(), data.size());
+    stream.close();
+
+    decode_indexed(info, palette, data, indexed);
+    return true;
+}
+
+/**
+ * Derives the pixel count, min, max and mean of each channel from its histogram
+ * Helper function for the image readers
+ * @param stats the statistics, with the histograms filled in
+ */
+void finish_stats(ImageStats &stats)
+{
+    for (int channel = 0; channel < STATS_CHANNELS; ++channel)
+    {
+        const long long *histogram = stats.histogram[channel];
+        long long count = 0;
+        long long sum = 0;
+        stats.min[channel] = 255;
+        stats.max[channel] = 0;
+        for (int value = 0; value < 256; ++value)
+        {
+            if (histogram[value] > 0)
+            {
+                stats.min[channel] = min(stats.min[channel], value);
+                stats.max[channel] = value;
+            }
+            count += histogram[value];
+            sum += histogram[value] * value;
+        }
+        stats.pixel_count = count;
+        stats.mean[channel] = count > 0 ? static_cast<double>(sum) / count : 0;
+    }
+}
+
+// Settings from the auto-tuner; zeros leave the built-in defaults
+static TuningProfile tuning = {"", 0, 0, 0};
+
+// Threads the calling thread may split work across, or 0 for no limit. The
+// workers of a Processor set it to 1, since the pool already fills the cores.
+static thread_local int thread_limit = 0;
+
+/**
+ * Limits the threads the filters called from this thread split their work
+ * across, for callers that already run filters on several threads at once
+ * @param threads the most threads, or 0 for no limit
+ * @return the previous limit, so that it can be restored
+ */
+int set_thread_limit(int threads)
+{
+    int previous = thread_limit;
+    thread_limit = max(0, threads);
+    return previous;
+}
+
+/**
+ * Returns the number of threads to split work across
+ * @return 1 on a Processor worker, otherwise the tuned thread count if there
+ *         is one, the hardware thread count, or 1 if it is unknown
+ */
+int thread_count()
+{
+    if (thread_limit > 0)
+    {
+        return thread_limit;
+    }
+    return tuning.threads > 0 ? tuning.threads : max(1u, thread::hardware_concurrency());
+}
+
+/**
+ * Expands an indexed image to pixels
+ * @param indexed the indexed image
+ * @param stats   if not nullptr, filled with the statistics of the image
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> expand_indexed(const IndexedImage &indexed, ImageStats *stats)
+{
+    vector<vector<Pixel>> image(indexed.indices.size());
+    if (stats)
+    {
+        *stats = ImageStats();
+    }
+    for (size_t row = 0; row < indexed.indices.size(); ++row)
+    {
+        image[row].reserve(indexed.indices[row].size());
+        for (unsigned char index : indexed.indices[row])
+        {
+            image[row].push_back(indexed.palette[index]);
+            if (stats)
+            {
+                add_to_stats(*stats, indexed.palette[index]);
+            }
+        }
+    }
+    if (stats)
+    {
+        finish_stats(*stats);
+    }
+    return image;
+}
+
+/**
+ * Gathers the statistics of an indexed image by counting each palette index,
+ * without expanding it to pixels
+ * @param indexed the indexed image
+ * @param stats   filled with the statistics of the image
+ */
+void indexed_stats(const IndexedImage &indexed, ImageStats &stats)
+{
+    long long counts[256] = {0};
+    for (const auto &row : indexed.indices)
+    {
+        for (unsigned char index : row)
+        {
+            counts[index]++;
+        }
+    }
+
+    stats = ImageStats();
+    for (size_t index = 0; index < indexed.palette.size(); ++index)
+    {
+        const Pixel &p = indexed.palette[index];
+        stats.histogram[STATS_RED][p.red] += counts[index];
+        stats.histogram[STATS_GREEN][p.green] += counts[index];
+        stats.histogram[STATS_BLUE][p.blue] += counts[index];
+        stats.histogram[STATS_LUMINANCE][(p.red + p.green + p.blue) / 3] += counts[index];
+    }
+    finish_stats(stats);
+}
+
+/**
+ * Decodes a band of rows from the raw pixel array of a 24 or 32-bit BMP image
+ * Helper function for read_image()
+ * @param pixels the pixel array as stored in the file
+ * @param info   the header fields of the image
+ * @param image  the image to decode into
+ * @param first  the first row of the band (top-down)
+ * @param last   one past the last row of the band
+ * @param stats  histograms for this band, or nullptr
+ */
+static void decode_rows(const vector<unsigned char> &pixels, const BmpInfo &info, vector<vector<Pixel>> &image,
+                        int first, int last, ImageStats *stats)
+{
+    int bytes_per_pixel = info.bits_per_pixel / 8;
+    for (int i = first; i < last; i++)
+    {
+        // Note: BMP files store pixels from bottom to top
+        const unsigned char *pixel = &pixels[static_cast<size_t>(info.height - 1 - i) * info.row_bytes];
+        for (int j = 0; j < info.width; j++)
+        {
+            // Note: BMP files store pixels in blue, green, red order
+            // We are ignoring the alpha channel if there is one
+            image[i][j].blue = pixel[0];
+            image[i][j].green = pixel[1];
+            image[i][j].red = pixel[2];
+            pixel += bytes_per_pixel;
+
+            if (stats)
+            {
+                add_to_stats(*stats, image[i][j]);
+            }
+        }
+    }
+}
+
+/**
+ * Reads the BMP image specified and returns the resulting image as a vector.
+ * The pixel array is read in one block and decoded in row bands across threads.
+ * Palettized images (1, 4 or 8 bits per pixel) are expanded to pixels.
+ * @param filename BMP image filename
+ * @param stats    if not nullptr, filled with the histograms, min, max and mean
+ *                 of the image, gathered by each thread during decode and merged
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> read_image(string filename, ImageStats *stats)
+{
+    // Open the binary file
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+
+    // Get the image properties and return empty vector if this is not a valid image
+    BmpInfo info;
+    if (!read_bmp_info(stream, info))
+    {
+        return {};
+    }
+
+    // Palettized images are decoded to indices and then expanded
+    if (info.bits_per_pixel <= 8)
+    {
+        IndexedImage indexed;
+        if (!read_indexed_image(filename, indexed))
+        {
+            return {};
+        }
+        return expand_indexed(indexed, stats);
+    }
+
+    // decode_rows() reads three bytes per pixel, so only 24 and 32-bit pixels are safe to hand it
+    if (info.bits_per_pixel != 24 && info.bits_per_pixel != 32)
+    {
+        return {};
+    }
+
+    // Read the whole pixel array, including the padding at the end of each row
+    vector<unsigned char> pixels(static_cast<size_t>(info.row_bytes) * info.height);
+    stream.seekg(info.start);
+    stream.read((char *)pixels.data(), pixels.size());
+    stream.close();
+
+    // Create a vector the size of the input image
+    vector<vector<Pixel>> image(info.height, vector<Pixel>(info.width));
+
+    // Decode bands of rows in parallel, each thread with its own histograms
+    int threads = min(thread_count(), max(1, info.height));
+    vector<ImageStats> partial_stats(stats ? threads : 0, ImageStats());
+    vector<thread> workers;
+    int band = (info.height + threads - 1) / threads;
+    for (int t = 0; t < threads; ++t)
+    {
+        int first = min(info.height, t * band);
+        int last = min(info.height, first + band);
+        workers.push_back(thread(decode_rows, cref(pixels), cref(info), ref(image), first, last,
+                                 stats ? &partial_stats[t] : nullptr));
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    // Merge the per-thread histograms
+    if (stats)
+    {
+        *stats = ImageStats();
+        for (const ImageStats &partial : partial_stats)
+        {
+            for (int channel = 0; channel < STATS_CHANNELS; ++channel)
+            {
+                for (int value = 0; value < 256; ++value)
+                {
+                    stats->histogram[channel][value] += partial.histogram[channel][value];
+                }
+            }
+        }
+        finish_stats(*stats);
+    }
+
+    return image;
+}
+
+/**
+ * Reads exactly the given number of bytes from a stream
+ * Helper function for read_image_stream()
+ * @param file  the stream
+ * @param data  where to store the bytes, or nullptr to discard them
+ * @param bytes the number of bytes
+ * @return true if the stream held that many bytes
+ */
+static bool read_stream_bytes(FILE *file, unsigned char *data, size_t bytes)
+{
+    unsigned char discard[4096];
+    while (bytes > 0)
+    {
+        size_t count = data ? bytes : min(bytes, sizeof(discard));
+        size_t got = fread(data ? data : discard, 1, count, file);
+        if (got == 0)
+        {
+            return false;
+        }
+        bytes -= got;
+        data = data ? data + got : nullptr;
+    }
+    return true;
+}
+
+/**
+ * Reads bytes from a stream into a vector that grows as they arrive, so that
+ * a size taken from a header is never allocated before the data is there
+ * Helper function for read_image_stream()
+ * @param file  the stream
+ * @param data  the bytes, replaced
+ * @param bytes the number of bytes to read
+ * @return false if the stream ended first
+ */
+static bool read_stream_vector(FILE *file, vector<unsigned char> &data, size_t bytes)
+{
+    const size_t block = 1 << 20;
+    data.clear();
+    while (data.size() < bytes)
+    {
+        size_t count = min(bytes - data.size(), block);
+        data.resize(data.size() + count);
+        if (!read_stream_bytes(file, &data[data.size() - count], count))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads and decodes the next scan line of a 24 or 32-bit pixel array from a stream
+ * Helper function for read_image_stream() and write_pyramid()
+ * @param file     the stream, positioned at the start of the scan line
+ * @param info     the header fields of the image
+ * @param scanline working space of info.row_bytes bytes, reused between rows
+ * @param row      the pixels of the row, info.width of them, filled in place
+ * @param stats    if not nullptr, the pixels are added to its histograms
+ * @return false if the stream ended before the end of the row
+ */
+static bool read_scanline(FILE *file, const BmpInfo &info, vector<unsigned char> &scanline, vector<Pixel> &row, ImageStats *stats)
+{
+    if (!read_stream_bytes(file, scanline.data(), scanline.size()))
+    {
+        return false;
+    }
+    int bytes_per_pixel = info.bits_per_pixel / 8;
+    const unsigned char *pixel = scanline.data();
+    for (int j = 0; j < info.width; j++)
+    {
+        row[j].blue = pixel[0];
+        row[j].green = pixel[1];
+        row[j].red = pixel[2];
+        pixel += bytes_per_pixel;
+
+        if (stats)
+        {
+            add_to_stats(*stats, row[j]);
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads a BMP image from a stream that cannot seek, such as a pipe. The
+ * headers, palette and pixel array are read strictly in file order and the
+ * pixel array one scan line at a time, so no more than one row is held
+ * beyond the image itself. Reading stops at the end of the image.
+ * @param file  the stream, e.g. stdin
+ * @param stats if not nullptr, filled with the histograms, min, max and mean
+ * @return the image as a vector of vector of Pixels, or empty if the stream
+ *         does not hold a valid image
+ */
+vector<vector<Pixel>> read_image_stream(FILE *file, ImageStats *stats)
+{
+    unsigned char header[BMP_INFO_BYTES];
+    BmpInfo info;
+    if (!read_stream_bytes(file, header, BMP_INFO_BYTES) || !parse_bmp_info(header, info) ||
+        info.start < BMP_INFO_BYTES)
+    {
+        return {};
+    }
+    size_t position = BMP_INFO_BYTES;
+
+    // Palettized images: the palette follows the DIB header, which must come before the pixel array
+    if (info.bits_per_pixel <= 8)
+    {
+        size_t palette_start = 14 + static_cast<size_t>(get_int(header, 14, 4));
+        vector<unsigned char> palette(info.colors * 4);
+        vector<unsigned char> data;
+        if (palette_start < position || palette_start + palette.size() > static_cast<size_t>(info.start) ||
+            !read_stream_bytes(file, nullptr, palette_start - position) ||
+            !read_stream_bytes(file, palette.data(), palette.size()) ||
+            !read_stream_bytes(file, nullptr, info.start - palette_start - palette.size()) ||
+            !read_stream_vector(file, data, info.file_size - info.start))
+        {
+            return {};
+        }
+        IndexedImage indexed;
+        decode_indexed(info, palette, data, indexed);
+        return expand_indexed(indexed, stats);
+    }
+
+    if (!read_stream_bytes(file, nullptr, info.start - position))
+    {
+        return {};
+    }
+
+    // BMP files store rows from bottom to top, so the image fills from its last row up
+    vector<vector<Pixel>> image(info.height, vector<Pixel>(info.width));
+    vector<unsigned char> scanline(info.row_bytes);
+    if (stats)
+    {
+        *stats = ImageStats();
+    }
+    for (int i = info.height - 1; i >= 0; i--)
+    {
+        if (!read_scanline(file, info, scanline, image[i], stats))
+        {
+            return {};
+        }
+    }
+    if (stats)
+    {
+        finish_stats(*stats);
+    }
+    return image;
+}
+
+/**
+ * Reads every step-th scan line and pixel of the BMP image specified, giving
+ * a preview that is step times smaller in each direction. Each kept row is
+ * found from its offset into the padded pixel array, so skipped rows are
+ * never read from the file.
+ * @param filename BMP image filename
+ * @param step     the decimation step (1 reads the full image)
+ * @param stats    if not nullptr, filled with the statistics of the preview
+ * @return the preview as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> read_image_preview(string filename, int step, ImageStats *stats)
+{
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+
+    BmpInfo info;
+    if (!read_bmp_info(stream, info) || info.bits_per_pixel < 24 || step < 1)
+    {
+        return {};
+    }
+
+    int bytes_per_pixel = info.bits_per_pixel / 8;
+    int preview_height = (info.height + step - 1) / step;
+    int preview_width = (info.width + step - 1) / step;
+    vector<vector<Pixel>> image(preview_height, vector<Pixel>(preview_width));
+    vector<unsigned char> scanline(info.row_bytes);
+    if (stats)
+    {
+        *stats = ImageStats();
+    }
+
+    for (int i = 0; i < preview_height; i++)
+    {
+        // BMP files store pixels from bottom to top
+        int file_row = info.height - 1 - i * step;
+        stream.seekg(info.start + static_cast<streamoff>(file_row) * info.row_bytes);
+        stream.read((char *)scanline.data(), info.row_bytes);
+
+        for (int j = 0; j < preview_width; j++)
+        {
+            const unsigned char *pixel = &scanline[j * step * bytes_per_pixel];
+            image[i][j].blue = pixel[0];
+            image[i][j].green = pixel[1];
+            image[i][j].red = pixel[2];
+
+            if (stats)
+            {
+                add_to_stats(*stats, image[i][j]);
+            }
+        }
+    }
+
+    stream.close();
+    if (stats)
+    {
+        finish_stats(*stats);
+    }
+    return image;
+}
+
+/**
+ * Clips a region to the bounds of an image
+ * @param region the region, clipped in place
+ * @param width  the image width
+ * @param height the image height
+ * @return true if any of the region is left
+ */
+bool clip_region(Region &region, int width, int height)
+{
+    int right = min(width, region.x + region.width);
+    int bottom = min(height, region.y + region.height);
+    region.x = max(0, region.x);
+    region.y = max(0, region.y);
+    region.width = right - region.x;
+    region.height = bottom - region.y;
+    return region.width > 0 && region.height > 0;
+}
+
+/**
+ * Reads only a rectangle of the BMP image specified. The file offset of each
+ * needed row and of the region's first column within it is computed directly,
+ * so rows and columns outside the region are never read or decoded.
+ * @param filename BMP image filename
+ * @param region   the region to read, clipped in place to the image bounds
+ * @param stats    if not nullptr, filled with the statistics of the region
+ * @return the region as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> read_image_region(string filename, Region &region, ImageStats *stats)
+{
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+
+    BmpInfo info;
+    if (!read_bmp_info(stream, info) || info.bits_per_pixel < 24 || !clip_region(region, info.width, info.height))
+    {
+        return {};
+    }
+
+    int bytes_per_pixel = info.bits_per_pixel / 8;
+    vector<vector<Pixel>> image(region.height, vector<Pixel>(region.width));
+    vector<unsigned char> scanline(region.width * bytes_per_pixel);
+    if (stats)
+    {
+        *stats = ImageStats();
+    }
+
+    for (int i = 0; i < region.height; i++)
+    {
+        // BMP files store pixels from bottom to top
+        int file_row = info.height - 1 - (region.y + i);
+        stream.seekg(info.start + static_cast<streamoff>(file_row) * info.row_bytes + region.x * bytes_per_pixel);
+        stream.read((char *)scanline.data(), scanline.size());
+
+        const unsigned char *pixel = scanline.data();
+        for (int j = 0; j < region.width; j++)
+        {
+            image[i][j].blue = pixel[0];
+            image[i][j].green = pixel[1];
+            image[i][j].red = pixel[2];
+            pixel += bytes_per_pixel;
+
+            if (stats)
+            {
+                add_to_stats(*stats, image[i][j]);
+            }
+        }
+    }
+
+    stream.close();
+    if (stats)
+    {
+        finish_stats(*stats);
+    }
+    return image;
+}
+
+/**
+ * Sets a value to the char array starting at the offset using the size
+ * specified by the bytes.
+ * This is a helper function for write_image()
+ * @param arr    Array to set values for
+ * @param offset Starting index offset
+ * @param bytes  Number of bytes to set
+ * @param value  Value to set
+ * @return nothing
+ */
+static void set_bytes(unsigned char arr[], int offset, int bytes, int value)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        arr[offset + i] = (unsigned char)(value >> (i * 8));
+    }
+}
+
+/**
+ * Builds the palette of an image and maps its pixels to palette indices.
+ * Channel values are taken modulo 256, as write_image() stores them.
+ * @param image   the image
+ * @param indexed the palette and indices, filled in place
+ * @return false if the image has more than 256 colors
+ */
+bool find_palette(const vector<vector<Pixel>> &image, IndexedImage &indexed)
+{
+    map<int, unsigned char> colors;
+    indexed.palette.clear();
+    indexed.indices.assign(image.size(), vector<unsigned char>(image.empty() ? 0 : image[0].size()));
+
+    // Neighbouring pixels are usually the same color, so remember the last lookup
+    int last_color = -1;
+    unsigned char last_index = 0;
+    for (size_t row = 0; row < image.size(); ++row)
+    {
+        for (size_t col = 0; col < image[row].size(); ++col)
+        {
+            const Pixel &p = image[row][col];
+            int color = ((unsigned char)p.red << 16) | ((unsigned char)p.green << 8) | (unsigned char)p.blue;
+            if (color != last_color)
+            {
+                auto found = colors.find(color);
+                if (found == colors.end())
+                {
+                    if (indexed.palette.size() == 256)
+                    {
+                        return false;
+                    }
+                    found = colors.insert(make_pair(color, (unsigned char)indexed.palette.size())).first;
+                    indexed.palette.push_back({color >> 16, (color >> 8) & 255, color & 255});
+                }
+                last_color = color;
+                last_index = found->second;
+            }
+            indexed.indices[row][col] = last_index;
+        }
+    }
+    return true;
+}
+
+/**
+ * Packs the indices of an image into padded scan lines, bottom row first
+ * Helper function for encode_indexed_image()
+ * @param indexed        the indexed image
+ * @param bits_per_pixel 1, 4 or 8
+ * @return the pixel array
+ */
+static vector<unsigned char> pack_indices(const IndexedImage &indexed, int bits_per_pixel)
+{
+    int width = indexed.indices[0].size();
+    int row_bytes = ((width * bits_per_pixel + 31) / 32) * 4;
+    int pixels_per_byte = 8 / bits_per_pixel;
+    vector<unsigned char> data(static_cast<size_t>(row_bytes) * indexed.indices.size(), 0);
+
+    size_t offset = 0;
+    for (int h = indexed.indices.size() - 1; h >= 0; h--)
+    {
+        const vector<unsigned char> &row = indexed.indices[h];
+        for (int w = 0; w < width; w++)
+        {
+            // The leftmost pixel sits in the most significant bits
+            int shift = (pixels_per_byte - 1 - w % pixels_per_byte) * bits_per_pixel;
+            data[offset + w / pixels_per_byte] |= row[w] << shift;
+        }
+        offset += row_bytes;
+    }
+    return data;
+}
+
+/**
+ * Run-length encodes the indices of an image as BI_RLE8 or BI_RLE4.
+ * Repeated indices become (count, index) pairs and stretches without repeats
+ * use absolute mode, bottom row first.
+ * Helper function for encode_indexed_image()
+ * @param indexed        the indexed image
+ * @param bits_per_pixel 8 for BI_RLE8, 4 for BI_RLE4
+ * @return the encoded pixel array
+ */
+static vector<unsigned char> encode_rle(const IndexedImage &indexed, int bits_per_pixel)
+{
+    int width = indexed.indices[0].size();
+    vector<unsigned char> data;
+
+    for (int h = indexed.indices.size() - 1; h >= 0; h--)
+    {
+        const vector<unsigned char> &row = indexed.indices[h];
+        int w = 0;
+        while (w < width)
+        {
+            int run = 1;
+            while (w + run < width && run < 255 && row[w + run] == row[w])
+            {
+                run++;
+            }
+
+            // Count the pixels up to the next repeat for absolute mode
+            int literal = 0;
+            while (w + literal < width && literal < 255 &&
+                   (w + literal + 1 == width || row[w + literal + 1] != row[w + literal]))
+            {
+                literal++;
+            }
+
+            if (run > 1 || literal < 3)
+            {
+                // Encoded mode: run copies of the index (both nibbles for BI_RLE4)
+                unsigned char index = bits_per_pixel == 4 ? (row[w] << 4) | row[w] : row[w];
+                data.push_back(run);
+                data.push_back(index);
+                w += run;
+                continue;
+            }
+
+            // Absolute mode: 0, count, then the indices padded to a 16-bit boundary
+            data.push_back(0);
+            data.push_back(literal);
+            size_t start = data.size();
+            for (int i = 0; i < literal; i++)
+            {
+                if (bits_per_pixel == 8)
+                {
+                    data.push_back(row[w + i]);
+                }
+                else if (i % 2 == 0)
+                {
+                    data.push_back(row[w + i] << 4);
+                }
+                else
+                {
+                    data.back() |= row[w + i];
+                }
+            }
+            if ((data.size() - start) % 2 != 0)
+            {
+                data.push_back(0);
+            }
+            w += literal;
+        }
+
+        // End of line, or end of bitmap after the top row
+        data.push_back(0);
+        data.push_back(h == 0 ? 1 : 0);
+    }
+    return data;
+}
+
+/**
+ * Fills in the BMP and DIB headers of an image
+ * Helper function for the image writers
+ * @param header         the BMP_INFO_BYTES bytes of the headers, filled in place
+ * @param width          width of the image in pixels
+ * @param height         height of the image in pixels
+ * @param bits_per_pixel number of bits per pixel
+ * @param compression    compression method (0=BI_RGB, 1=BI_RLE8, 2=BI_RLE4)
+ * @param palette_size   number of colors in the palette that follows the headers
+ * @param array_bytes    size of the pixel array in bytes, including padding
+ */
+static void set_bmp_headers(unsigned char header[], int width, int height, int bits_per_pixel, int compression,
+                            int palette_size, int array_bytes)
+{
+    const int BMP_HEADER_SIZE = 14;
+    const int DIB_HEADER_SIZE = 40;
+    int array_offset = BMP_HEADER_SIZE + DIB_HEADER_SIZE + palette_size * 4;
+    unsigned char *bmp_header = header;
+    unsigned char *dib_header = header + BMP_HEADER_SIZE;
+
+    // BMP Header
+    set_bytes(bmp_header, 0, 1, 'B');                        // ID field
+    set_bytes(bmp_header, 1, 1, 'M');                        // ID field
+    set_bytes(bmp_header, 2, 4, array_offset + array_bytes); // Size of BMP file
+    set_bytes(bmp_header, 6, 2, 0);                          // Reserved
+    set_bytes(bmp_header, 8, 2, 0);                          // Reserved
+    set_bytes(bmp_header, 10, 4, array_offset);              // Pixel array offset
+
+    // DIB Header
+    set_bytes(dib_header, 0, 4, DIB_HEADER_SIZE); // DIB header size
+    set_bytes(dib_header, 4, 4, width);           // Width of bitmap in pixels
+    set_bytes(dib_header, 8, 4, height);          // Height of bitmap in pixels
+    set_bytes(dib_header, 12, 2, 1);              // Number of color planes
+    set_bytes(dib_header, 14, 2, bits_per_pixel); // Number of bits per pixel
+    set_bytes(dib_header, 16, 4, compression);    // Compression method (0=BI_RGB, 1=BI_RLE8, 2=BI_RLE4)
+    set_bytes(dib_header, 20, 4, array_bytes);    // Size of raw bitmap data (including padding)
+    set_bytes(dib_header, 24, 4, 2835);           // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 28, 4, 2835);           // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 32, 4, palette_size);   // Number of colors in palette
+    set_bytes(dib_header, 36, 4, 0);              // Number of important colors
+}
+
+/**
+ * Encodes an indexed image as a palettized BMP, using the fewest bits per
+ * pixel its palette allows. With compression the BI_RLE4 / BI_RLE8 encoding is
+ * used when it comes out smaller than the uncompressed pixel array.
+ * @param indexed  The indexed image to encode
+ * @param compress Whether to try run-length encoding
+ * @return the bytes of the BMP file
+ */
+vector<unsigned char> encode_indexed_image(const IndexedImage &indexed, bool compress)
+{
+    int width_pixels = indexed.indices[0].size();
+    int height_pixels = indexed.indices.size();
+    int palette_size = indexed.palette.size();
+
+    int bits_per_pixel = palette_size <= 2 ? 1 : palette_size <= 16 ? 4 : 8;
+    int compression = 0;
+    vector<unsigned char> data = pack_indices(indexed, bits_per_pixel);
+    if (compress)
+    {
+        // BI_RLE4 also covers two-color images, which have no RLE format of their own
+        int rle_bits = bits_per_pixel == 8 ? 8 : 4;
+        vector<unsigned char> encoded = encode_rle(indexed, rle_bits);
+        if (encoded.size() < data.size())
+        {
+            data.swap(encoded);
+            bits_per_pixel = rle_bits;
+            compression = rle_bits == 8 ? 1 : 2;
+        }
+    }
+
+    // Headers, then the palette as blue, green, red, reserved, then the pixel array
+    vector<unsigned char> bytes(BMP_INFO_BYTES + palette_size * 4, 0);
+    set_bmp_headers(bytes.data(), width_pixels, height_pixels, bits_per_pixel, compression, palette_size, data.size());
+    for (int i = 0; i < palette_size; i++)
+    {
+        bytes[BMP_INFO_BYTES + i * 4] = indexed.palette[i].blue;
+        bytes[BMP_INFO_BYTES + i * 4 + 1] = indexed.palette[i].green;
+        bytes[BMP_INFO_BYTES + i * 4 + 2] = indexed.palette[i].red;
+    }
+    bytes.insert(bytes.end(), data.begin(), data.end());
+    return bytes;
+}
+
+/**
+ * Writes an indexed image to a palettized BMP file, as encode_indexed_image() encodes it
+ * @param filename The BMP file name to save the image to
+ * @param indexed  The indexed image to save
+ * @param compress Whether to try run-length encoding
+ * @return True if successful and false otherwise
+ */
+bool write_indexed_image(string filename, const IndexedImage &indexed, bool compress)
+{
+    vector<unsigned char> bytes = encode_indexed_image(indexed, compress);
+
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    stream.write((char *)bytes.data(), bytes.size());
+    stream.close();
+    return true;
+}
+
+/**
+ * Write the input image to a BMP file name specified
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @param format   The pixel format; indexed formats fall back to 24 bits
+ *                 per pixel if the image has more than 256 colors
+ * @return True if successful and false otherwise
+ */
+bool write_image(string filename, const vector<vector<Pixel>> &image, BmpFormat format)
+{
+    // Write with a palette if asked and the image has few enough colors
+    IndexedImage indexed;
+    if (format != BMP_RGB24 && find_palette(image, indexed))
+    {
+        return write_indexed_image(filename, indexed, format == BMP_INDEXED_RLE);
+    }
+
+    // Get the image width and height in pixels
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+
+    // Calculate the width in bytes incorporating padding (4 byte alignment)
+    int width_bytes = width_pixels * 3;
+    int padding_bytes = 0;
+    padding_bytes = (4 - width_bytes % 4) % 4;
+    width_bytes = width_bytes + padding_bytes;
+
+    // Pixel array size in bytes, including padding
+    int array_bytes = width_bytes * height_pixels;
+
+    // Open a file stream for writing to a binary file
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
+
+    // If there was a problem opening the file, return false
+    if (!stream.is_open())
+    {
+        return false;
+    }
+
+    // Write the BMP and DIB Headers to the file
+    unsigned char header[BMP_INFO_BYTES] = {0};
+    set_bmp_headers(header, width_pixels, height_pixels, 24, 0, 0, array_bytes);
+    stream.write((char *)header, sizeof(header));
+
+    // Initialize pixel and padding
+    unsigned char pixel[3] = {0};
+    unsigned char padding[3] = {0};
+
+    // Pixel Array (Left to right, bottom to top, with padding)
+    for (int h = height_pixels - 1; h >= 0; h--)
+    {
+        for (int w = 0; w < width_pixels; w++)
+        {
+            // Write the pixel (Blue, Green, Red)
+            pixel[0] = image[h][w].blue;
+            pixel[1] = image[h][w].green;
+            pixel[2] = image[h][w].red;
+            stream.write((char *)pixel, 3);
+        }
+        // Write the padding bytes
+        stream.write((char *)padding, padding_bytes);
+    }
+
+    // Close the stream and return true
+    stream.close();
+    return true;
+}
+
+// Bytes of output handed to a stream at a time
+const size_t STREAM_BLOCK_BYTES = 1 << 20;
+
+/**
+ * Allocates a block of output for write_stream_block(). On Linux the block
+ * is mapped pages of its own, so that they can be handed to a pipe.
+ * @param bytes the size of the block
+ * @return the block, or nullptr if it could not be allocated
+ */
+static unsigned char *stream_block(size_t bytes)
+{
+#ifdef __linux__
+    void *block = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return block == MAP_FAILED ? nullptr : (unsigned char *)block;
+#else
+    return (unsigned char *)malloc(bytes);
+#endif
+}
+
+/**
+ * Writes a block from stream_block() to a stream and releases it. When the
+ * stream is a pipe the block's pages are spliced into it with vmsplice
+ * instead of being copied; they are unmapped straight after, so nothing can
+ * change them while the reader still has them.
+ * @param file  the stream, e.g. stdout
+ * @param block the block
+ * @param bytes the size of the block
+ * @return true if the whole block was written
+ */
+static bool write_stream_block(FILE *file, unsigned char *block, size_t bytes)
+{
+    bool written = true;
+#ifdef __linux__
+    int fd = fileno(file);
+    struct stat status;
+    bool pipe = fstat(fd, &status) == 0 && S_ISFIFO(status.st_mode);
+    if (pipe)
+    {
+        // A larger pipe takes a whole block per wake-up of the reader; failing that the default size will do
+        fcntl(fd, F_SETPIPE_SZ, static_cast<int>(STREAM_BLOCK_BYTES));
+    }
+
+    size_t done = 0;
+    while (written && done < bytes)
+    {
+        ssize_t count;
+        if (pipe)
+        {
+            iovec chunk = {block + done, bytes - done};
+            count = vmsplice(fd, &chunk, 1, SPLICE_F_GIFT);
+            if (count < 0 && errno != EINTR)
+            {
+                // Copy the rest if the kernel will not splice
+                pipe = false;
+                continue;
+            }
+        }
+        else
+        {
+            count = write(fd, block + done, bytes - done);
+        }
+
+        if (count > 0)
+        {
+            done += count;
+        }
+        else if (count == 0 || errno != EINTR)
+        {
+            written = false;
+        }
+    }
+    munmap(block, bytes);
+#else
+    written = fwrite(block, 1, bytes, file) == bytes;
+    free(block);
+#endif
+    return written;
+}
+
+/**
+ * Writes the input image as a BMP to a stream that cannot seek, such as a
+ * pipe. The headers and scan lines are encoded in blocks of about
+ * STREAM_BLOCK_BYTES, bottom row first, and each block is handed to the
+ * stream as soon as it is encoded.
+ * @param file   the stream, e.g. stdout
+ * @param image  The input image to save
+ * @param format The pixel format, as for write_image()
+ * @return True if successful and false otherwise
+ */
+bool write_image_stream(FILE *file, const vector<vector<Pixel>> &image, BmpFormat format)
+{
+    // Anything buffered must go out ahead of the blocks, which bypass the buffer on Linux
+    fflush(file);
+
+    // Palettized images are small; they are encoded whole and written as one block
+    IndexedImage indexed;
+    if (format != BMP_RGB24 && find_palette(image, indexed))
+    {
+        vector<unsigned char> bytes = encode_indexed_image(indexed, format == BMP_INDEXED_RLE);
+        unsigned char *block = stream_block(bytes.size());
+        if (!block)
+        {
+            return false;
+        }
+        copy(bytes.begin(), bytes.end(), block);
+        return write_stream_block(file, block, bytes.size());
+    }
+
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+    size_t row_bytes = ((width_pixels * 24 + 31) / 32) * 4;
+    int block_rows = max<size_t>(1, STREAM_BLOCK_BYTES / row_bytes);
+
+    // The first block starts with the headers
+    size_t header_bytes = BMP_INFO_BYTES;
+    for (int h = height_pixels - 1; h >= 0; h -= block_rows)
+    {
+        int rows = min(block_rows, h + 1);
+        size_t bytes = header_bytes + row_bytes * rows;
+        unsigned char *block = stream_block(bytes);
+        if (!block)
+        {
+            return false;
+        }
+        fill(block, block + bytes, 0);
+        if (header_bytes > 0)
+        {
+            set_bmp_headers(block, width_pixels, height_pixels, 24, 0, 0, row_bytes * height_pixels);
+        }
+
+        // Pixel Array (Left to right, bottom to top, with padding)
+        unsigned char *row = block + header_bytes;
+        for (int r = h; r > h - rows; r--)
+        {
+            unsigned char *pixel = row;
+            for (int w = 0; w < width_pixels; w++)
+            {
+                pixel[0] = image[r][w].blue;
+                pixel[1] = image[r][w].green;
+                pixel[2] = image[r][w].red;
+                pixel += 3;
+            }
+            row += row_bytes;
+        }
+
+        if (!write_stream_block(file, block, bytes))
+        {
+            return false;
+        }
+        header_bytes = 0;
+    }
+    return true;
+}
+
+/**
+ * Copies a BMP file unchanged to a stream. On Linux the file is spliced
+ * straight into the stream when the stream is a pipe, so its bytes never
+ * pass through this process.
+ * @param filename the BMP file
+ * @param file     the stream, e.g. stdout
+ * @return True if successful and false otherwise
+ */
+bool copy_image_stream(string filename, FILE *file)
+{
+    fflush(file);
+#ifdef __linux__
+    int input = open(filename.c_str(), O_RDONLY);
+    if (input < 0)
+    {
+        return false;
+    }
+    int output = fileno(file);
+    fcntl(output, F_SETPIPE_SZ, static_cast<int>(STREAM_BLOCK_BYTES));
+    vector<unsigned char> buffer;
+    bool copied = true;
+    while (copied)
+    {
+        ssize_t count;
+        if (buffer.empty())
+        {
+            count = splice(input, nullptr, output, nullptr, STREAM_BLOCK_BYTES, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (count < 0 && errno == EINVAL)
+            {
+                // Neither end is a pipe; copy the rest through a buffer instead
+                buffer.resize(STREAM_BLOCK_BYTES);
+                continue;
+            }
+        }
+        else
+        {
+            count = read(input, buffer.data(), buffer.size());
+            for (ssize_t done = 0; count > 0 && done < count;)
+            {
+                ssize_t written = write(output, buffer.data() + done, count - done);
+                if (written > 0)
+                {
+                    done += written;
+                }
+                else if (written == 0 || errno != EINTR)
+                {
+                    count = -1;
+                }
+            }
+        }
+
+        if (count == 0)
+        {
+            break;
+        }
+        copied = count > 0 || errno == EINTR;
+    }
+    close(input);
+    return copied;
+#else
+    ifstream input(filename, ios::in | ios::binary);
+    if (!input.is_open())
+    {
+        return false;
+    }
+    vector<char> buffer(STREAM_BLOCK_BYTES);
+    while (input.read(buffer.data(), buffer.size()) || input.gcount() > 0)
+    {
+        if (fwrite(buffer.data(), 1, input.gcount(), file) != static_cast<size_t>(input.gcount()))
+        {
+            return false;
+        }
+    }
+    return true;
+#endif
+}
+
+/**
+ * Writes a region back into a copy of the full BMP image. The input file is
+ * copied byte for byte and only the pixels of the region are overwritten in
+ * place, so rows outside the region are never decoded or re-encoded. Any
+ * alpha channel of the input is left untouched. The copy is patched under a
+ * temporary name and then renamed to output_filename, so the input survives
+ * even when output_filename names the same file by another path.
+ * @param input_filename  the full BMP image the region was read from
+ * @param output_filename the BMP file name to save the copy to
+ * @param region          where the region sits in the full image
+ * @param image           the region, the same size as region
+ * @return True if successful and false otherwise
+ */
+bool write_image_region(string input_filename, string output_filename, const Region &region, const vector<vector<Pixel>> &image)
+{
+    if (static_cast<int>(image.size()) != region.height || static_cast<int>(image[0].size()) != region.width)
+    {
+        return false;
+    }
+
+    // Copy the full image
+    string temporary_filename = output_filename + ".tmp";
+    {
+        ifstream input(input_filename, ios::in | ios::binary);
+        ofstream output(temporary_filename, ios::out | ios::binary);
+        if (!input.is_open() || !output.is_open())
+        {
+            return false;
+        }
+        output << input.rdbuf();
+    }
+
+    fstream stream;
+    stream.open(temporary_filename, ios::in | ios::out | ios::binary);
+    BmpInfo info;
+    if (!stream.is_open() || !read_bmp_info(stream, info) ||
+        region.x + region.width > info.width || region.y + region.height > info.height)
+    {
+        remove(temporary_filename.c_str());
+        return false;
+    }
+
+    // Read each row of the region, patch its color bytes and write it back at the same offset
+    int bytes_per_pixel = info.bits_per_pixel / 8;
+    vector<unsigned char> scanline(region.width * bytes_per_pixel);
+    for (int i = 0; i < region.height; i++)
+    {
+        int file_row = info.height - 1 - (region.y + i);
+        streamoff offset = info.start + static_cast<streamoff>(file_row) * info.row_bytes + region.x * bytes_per_pixel;
+        stream.seekg(offset);
+        stream.read((char *)scanline.data(), scanline.size());
+
+        unsigned char *pixel = scanline.data();
+        for (int j = 0; j < region.width; j++)
+        {
+            pixel[0] = image[i][j].blue;
+            pixel[1] = image[i][j].green;
+            pixel[2] = image[i][j].red;
+            pixel += bytes_per_pixel;
+        }
+
+        stream.seekp(offset);
+        stream.write((char *)scanline.data(), scanline.size());
+    }
+
+    stream.close();
+    if (stream.fail() || rename(temporary_filename.c_str(), output_filename.c_str()) != 0)
+    {
+        remove(temporary_filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Process 1 - vignette effect
+vector<vector<Pixel>> process_1(const vector<vector<Pixel>> &image)
+{
+    // Get the number of rows/columns from the input 2D vector (remember: num_rows is height, num_columns is width)
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+
+    // Calculating the center of the image
+    double center_row = num_rows / 2;
+    double center_col = num_columns / 2;
+
+    // Define a new 2D vector the same size as the input 2D vector
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+    // For each of the rows in the input 2D vector
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (int col = 0; col < num_columns; ++col)
+        {
+            // Distance to the center
+            double distance = sqrt(pow(col - center_col, 2) + pow(row - center_row, 2));
+            double scaling_factor = (num_rows - distance) / num_rows;
+
+            // Scale new color values
+            int new_red = static_cast<int>(image[row][col].red * scaling_factor);
+            int new_green = static_cast<int>(image[row][col].green * scaling_factor);
+            int new_blue = static_cast<int>(image[row][col].blue * scaling_factor);
+
+            // Set new pixel values
+            new_image[row][col].red = new_red;
+            new_image[row][col].green = new_green;
+            new_image[row][col].blue = new_blue;
+        }
+    }
+
+    return new_image;
+}
+
+// Process 2 - clarendon effect
+vector<vector<Pixel>> process_2(const vector<vector<Pixel>> &image, double scaling_factor)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (int col = 0; col < num_columns; ++col)
+        {
+            const Pixel &p = image[row][col];
+            int red_value = p.red;
+            int green_value = p.green;
+            int blue_value = p.blue;
+
+            // Average the values
+            int average_value = (red_value + green_value + blue_value) / 3;
+
+            int new_red, new_green, new_blue;
+
+            // Adjusting pixel brightness according to average_value
+            if (average_value >= 170)
+            {
+                new_red = static_cast<int>(255 - (255 - red_value) * scaling_factor);
+                new_green = static_cast<int>(255 - (255 - green_value) * scaling_factor);
+                new_blue = static_cast<int>(255 - (255 - blue_value) * scaling_factor);
+            }
+            else if (average_value < 90)
+            {
+                new_red = static_cast<int>(red_value * scaling_factor);
+                new_green = static_cast<int>(green_value * scaling_factor);
+                new_blue = static_cast<int>(blue_value * scaling_factor);
+            }
+            else
+            {
+                new_red = red_value;
+                new_green = green_value;
+                new_blue = blue_value;
+            }
+
+            new_image[row][col].red = new_red;
+            new_image[row][col].green = new_green;
+            new_image[row][col].blue = new_blue;
+        }
+    }
+    return new_image;
+}
+
+// Process 3 - grayscale image
+vector<vector<Pixel>> process_3(const vector<vector<Pixel>> &image)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (int col = 0; col < num_columns; ++col)
+        {
+            const Pixel &p = image[row][col];
+            int red_value = p.red;
+            int green_value = p.green;
+            int blue_value = p.blue;
+
+            // Calculate Gray Value
+            int gray_value = (red_value + green_value + blue_value) / 3;
+
+            // Set pixels to gray value
+
+            int new_red = gray_value;
+            int new_green = gray_value;
+            int new_blue = gray_value;
+
+            new_image[row][col].red = new_red;
+            new_image[row][col].green = new_green;
+            new_image[row][col].blue = new_blue;
+        }
+    }
+
+    return new_image;
+}
+
+// Process 4 - rotates image by 90 degrees clockwise (not counter-clockwise)
+vector<vector<Pixel>> process_4(const vector<vector<Pixel>> &image)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+
+    vector<vector<Pixel>> new_image(num_columns, vector<Pixel>(num_rows));
+
+    // Rotating a block at a time keeps the output rows being written in cache
+    int block = tuning.rotate_tile > 0 ? tuning.rotate_tile : max(num_rows, num_columns);
+    for (int first_row = 0; first_row < num_rows; first_row += block)
+    {
+        for (int first_col = 0; first_col < num_columns; first_col += block)
+        {
+            for (int row = first_row; row < min(num_rows, first_row + block); ++row)
+            {
+                for (int col = first_col; col < min(num_columns, first_col + block); ++col)
+                {
+                    const Pixel &p = image[row][col];
+
+                    // 90 degree rotation logic
+                    new_image[col][num_rows - 1 - row] = p;
+                }
+            }
+        }
+    }
+
+    return new_image;
+}
+
+// Process 5 - rotates image clockwise by a specified number of multiples of 90 degrees
+vector<vector<Pixel>> process_5(const vector<vector<Pixel>> &image, int number)
+{
+    vector<vector<Pixel>> new_image = image;
+
+    // Normalize the number of rotations for optimization
+    number = number % 4;
+
+    for (int i = 0; i < number; ++i)
+    {
+        new_image = process_4(new_image);
+    }
+
+    return new_image;
+}
+
+// Process 6 - enlarges the image in the x and y direction
+vector<vector<Pixel>> process_6(const vector<vector<Pixel>> &image, int x_scale, int y_scale)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+
+    int new_height = num_rows * y_scale;
+    int new_width = num_columns * x_scale;
+
+    vector<vector<Pixel>> new_image(new_height, vector<Pixel>(new_width));
+
+    for (int row = 0; row < new_height; ++row)
+    {
+        for (int col = 0; col < new_width; ++col)
+        {
+            // Calculate the corresponding pixel in the original image
+            int orig_row = floor(row / static_cast<double>(y_scale));
+            int orig_col = floor(col / static_cast<double>(x_scale));
+
+            // Set the pixel in the new image
+            new_image[row][col] = image[orig_row][orig_col];
+        }
+    }
+
+    return new_image;
+}
+
+// Process 7 - Convert image to high contrast (black and white only)
+// Pixels whose gray value reaches the threshold become white, the rest black
+vector<vector<Pixel>> process_7(const vector<vector<Pixel>> &image, int threshold)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (int col = 0; col < num_columns; ++col)
+        {
+            const Pixel &p = image[row][col];
+            int red_value = p.red;
+            int green_value = p.green;
+            int blue_value = p.blue;
+
+            // Calculate Gray Value
+            int gray_value = (red_value + green_value + blue_value) / 3;
+
+            int new_red, new_green, new_blue;
+
+            if (gray_value >= threshold)
+            {
+                new_red = 255;
+                new_green = 255;
+                new_blue = 255;
+            }
+            else
+            {
+                new_red = 0;
+                new_green = 0;
+                new_blue = 0;
+            }
+
+            new_image[row][col].red = new_red;
+            new_image[row][col].green = new_green;
+            new_image[row][col].blue = new_blue;
+        }
+    }
+
+    return new_image;
+}
+
+// Process 8 - Lightens image by a scaling factor
+vector<vector<Pixel>> process_8(const vector<vector<Pixel>> &image, double scaling_factor)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (int col = 0; col < num_columns; ++col)
+        {
+            const Pixel &p = image[row][col];
+            int red_value = p.red;
+            int green_value = p.green;
+            int blue_value = p.blue;
+
+            int new_red = static_cast<int>(255 - (255 - red_value) * scaling_factor);
+            int new_green = static_cast<int>(255 - (255 - green_value) * scaling_factor);
+            int new_blue = static_cast<int>(255 - (255 - blue_value) * scaling_factor);
+
+            new_image[row][col].red = new_red;
+            new_image[row][col].green = new_green;
+            new_image[row][col].blue = new_blue;
+        }
+    }
+
+    return new_image;
+}
+
+// Process 9 - Darkens image by a scaling factor
+vector<vector<Pixel>> process_9(const vector<vector<Pixel>> &image, double scaling_factor)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (int col = 0; col < num_columns; ++col)
+        {
+            const Pixel &p = image[row][col];
+            int red_value = p.red;
+            int green_value = p.green;
+            int blue_value = p.blue;
+
+            int new_red = static_cast<int>(red_value * scaling_factor);
+            int new_green = static_cast<int>(green_value * scaling_factor);
+            int new_blue = static_cast<int>(blue_value * scaling_factor);
+
+            new_image[row][col].red = new_red;
+            new_image[row][col].green = new_green;
+            new_image[row][col].blue = new_blue;
+        }
+    }
+
+    return new_image;
+}
+
+// Process 10 - Converts image to only black, white, red, blue, and green
+vector<vector<Pixel>> process_10(const vector<vector<Pixel>> &image)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (int col = 0; col < num_columns; ++col)
+        {
+            const Pixel &p = image[row][col];
+            int red_value = p.red;
+            int green_value = p.green;
+            int blue_value = p.blue;
+
+            int total_color = red_value + green_value + blue_value;
+            int new_red, new_green, new_blue;
+
+            // Based on total color value, default to black or white
+            new_red = new_green = new_blue = (total_color >= 550) ? 255 : 0;
+
+            // Adjust for dominant color
+            if (total_color > 150 && total_color < 550)
+            {
+                int max_color = max({red_value, green_value, blue_value});
+                new_red = (max_color == red_value) ? 255 : 0;
+                new_green = (max_color == green_value) ? 255 : 0;
+                new_blue = (max_color == blue_value) ? 255 : 0;
+            }
+
+            new_image[row][col].red = new_red;
+            new_image[row][col].green = new_green;
+            new_image[row][col].blue = new_blue;
+        }
+    }
+    return new_image;
+}
+
+// Process 7 (indexed) - high contrast, emitting palette indices instead of pixels
+IndexedImage process_7_indexed(const vector<vector<Pixel>> &image, int threshold)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+
+    IndexedImage new_image;
+    new_image.palette = {{0, 0, 0}, {255, 255, 255}};
+    new_image.indices.assign(num_rows, vector<unsigned char>(num_columns));
+
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (int col = 0; col < num_columns; ++col)
+        {
+            const Pixel &p = image[row][col];
+            int gray_value = (p.red + p.green + p.blue) / 3;
+            new_image.indices[row][col] = gray_value >= threshold ? 1 : 0;
+        }
+    }
+
+    return new_image;
+}
+
+// Process 10 (indexed) - black, white, red, green and blue, emitting palette indices
+// Ties between dominant channels give their mixes, so the palette holds every
+// combination of full and empty channels, indexed by red << 2 | green << 1 | blue
+IndexedImage process_10_indexed(const vector<vector<Pixel>> &image)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+
+    IndexedImage new_image;
+    for (int index = 0; index < 8; ++index)
+    {
+        new_image.palette.push_back({index & 4 ? 255 : 0, index & 2 ? 255 : 0, index & 1 ? 255 : 0});
+    }
+    new_image.indices.assign(num_rows, vector<unsigned char>(num_columns));
+
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (int col = 0; col < num_columns; ++col)
+        {
+            const Pixel &p = image[row][col];
+            int total_color = p.red + p.green + p.blue;
+
+            // Based on total color value, default to black or white
+            unsigned char index = (total_color >= 550) ? 7 : 0;
+
+            // Adjust for dominant color
+            if (total_color > 150 && total_color < 550)
+            {
+                int max_color = max({p.red, p.green, p.blue});
+                index = (max_color == p.red ? 4 : 0) | (max_color == p.green ? 2 : 0) | (max_color == p.blue ? 1 : 0);
+            }
+
+            new_image.indices[row][col] = index;
+        }
+    }
+    return new_image;
+}
+
+/**
+ * Finds the value below which the given fraction of a channel's pixels fall
+ * @param stats    the image statistics
+ * @param channel  the channel
+ * @param fraction the fraction of pixels, from 0 to 1
+ * @return the percentile value
+ */
+int stats_percentile(const ImageStats &stats, int channel, double fraction)
+{
+    long long target = static_cast<long long>(fraction * stats.pixel_count);
+    long long count = 0;
+    for (int value = 0; value < 256; ++value)
+    {
+        count += stats.histogram[channel][value];
+        if (count > target)
+        {
+            return value;
+        }
+    }
+    return 255;
+}
+
+/**
+ * Picks the high contrast threshold that best splits the luminance histogram
+ * into dark and light classes (Otsu's method, maximizing between-class variance)
+ * @param stats the image statistics
+ * @return the threshold for process_7
+ */
+int auto_threshold(const ImageStats &stats)
+{
+    const long long *histogram = stats.histogram[STATS_LUMINANCE];
+    double total_sum = stats.mean[STATS_LUMINANCE] * stats.pixel_count;
+    double dark_sum = 0;
+    long long dark_count = 0;
+    double best_variance = -1;
+    int threshold = 255 / 2;
+
+    // Pixels below the threshold are dark
+    for (int value = 1; value < 256; ++value)
+    {
+        dark_count += histogram[value - 1];
+        dark_sum += static_cast<double>(histogram[value - 1]) * (value - 1);
+        long long light_count = stats.pixel_count - dark_count;
+        if (dark_count == 0 || light_count == 0)
+        {
+            continue;
+        }
+
+        double mean_difference = dark_sum / dark_count - (total_sum - dark_sum) / light_count;
+        double variance = static_cast<double>(dark_count) * light_count * mean_difference * mean_difference;
+        if (variance > best_variance)
+        {
+            best_variance = variance;
+            threshold = value;
+        }
+    }
+    return threshold;
+}
+
+/**
+ * Picks a clarendon scaling factor from the spread of the luminance histogram.
+ * The factor is the 5th-95th percentile spread as a fraction of the full range,
+ * so flat images get the strongest effect and contrasty images are barely changed.
+ * @param stats the image statistics
+ * @return the scaling factor for process_2, between 0.3 and 1
+ */
+double auto_clarendon_factor(const ImageStats &stats)
+{
+    int spread = stats_percentile(stats, STATS_LUMINANCE, 0.95) - stats_percentile(stats, STATS_LUMINANCE, 0.05);
+    return min(1.0, max(0.3, spread / 255.0));
+}
+
+// Process 2 (auto) - clarendon effect with the scaling factor picked from the image statistics
+vector<vector<Pixel>> process_2_auto(const vector<vector<Pixel>> &image, const ImageStats &stats)
+{
+    return process_2(image, auto_clarendon_factor(stats));
+}
+
+// Process 7 (auto) - high contrast with the threshold picked from the image statistics
+vector<vector<Pixel>> process_7_auto(const vector<vector<Pixel>> &image, const ImageStats &stats)
+{
+    return process_7(image, auto_threshold(stats));
+}
+
+// Auto levels - stretches each channel so its darkest value becomes 0 and its brightest 255
+vector<vector<Pixel>> process_auto_levels(const vector<vector<Pixel>> &image, const ImageStats &stats)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+
+    // Lookup table per channel, built from the min and max gathered at decode
+    int levels[3][256];
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        int low = stats.min[channel];
+        int range = max(1, stats.max[channel] - low);
+        for (int value = 0; value < 256; ++value)
+        {
+            levels[channel][value] = min(255, max(0, (value - low) * 255 / range));
+        }
+    }
+
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (int col = 0; col < num_columns; ++col)
+        {
+            const Pixel &p = image[row][col];
+            new_image[row][col].red = levels[STATS_RED][p.red];
+            new_image[row][col].green = levels[STATS_GREEN][p.green];
+            new_image[row][col].blue = levels[STATS_BLUE][p.blue];
+        }
+    }
+
+    return new_image;
+}
+
+// Convolution
+// Neighborhood filters are built from separable passes, each run along the
+// rows and then down the columns, with the image edges extended by repeating
+// the outermost pixels. A box pass keeps a running sum, so its cost does not
+// depend on its radius; a weighted pass multiplies out a sampled kernel in
+// fixed point. The image is split into bands of rows that threads filter
+// independently, each small enough to stay in cache. A band also filters a
+// halo of rows above and below it, as many as the passes reach together, so
+// that its own rows come out exactly as if the whole image were one band.
+const size_t CONVOLUTION_BAND_BYTES = 256 * 1024; // Working set of one band, halo included
+const double GAUSSIAN_BOX_SIGMA = 2.0;            // From here on a Gaussian is three box passes
+const int BOX_SHIFT = 48;
+const int MAX_BOX_RADIUS = (1 << 19) - 1; // Largest box whose average box_average() rounds exactly
+
+/**
+ * Returns the working set of one convolution band
+ * @return the tuned size if there is one, otherwise CONVOLUTION_BAND_BYTES
+ */
+static size_t convolution_band_bytes()
+{
+    return tuning.band_bytes > 0 ? tuning.band_bytes : CONVOLUTION_BAND_BYTES;
+}
+
+/**
+ * Rounds a box sum divided by the box size, as a multiply and shift
+ * Helper function for the box passes
+ * @param sum        the sum of the box, plus half the box size
+ * @param reciprocal 2^BOX_SHIFT divided by the box size, rounded up
+ * @return the average
+ */
+inline int box_average(int sum, long long reciprocal)
+{
+    return static_cast<int>((sum * reciprocal) >> BOX_SHIFT);
+}
+
+/**
+ * Runs one pass along a row of channel values, in place
+ * Helper function for convolve_band()
+ * @param row     red, green, blue values of each pixel of the row
+ * @param width   the width of the row in pixels
+ * @param pass    the pass
+ * @param scratch working space, reused between rows
+ */
+static void convolve_row(int *row, int width, const ConvolutionPass &pass, vector<int> &scratch)
+{
+    int radius = pass.radius;
+    int size = 2 * radius + 1;
+    if (pass.weights.empty())
+    {
+        // The window of pixel x spans x - radius to x + radius, with the edge
+        // pixels repeated beyond the row. The radius may be far wider than the
+        // row, so the window it starts with adds those repeats as multiples.
+        scratch.assign(row, row + width * 3);
+        auto pixel = [&](int x)
+        { return &scratch[min(max(x, 0), width - 1) * 3]; };
+        const int *first = pixel(0);
+        const int *last = pixel(width - 1);
+        int inside = min(radius, width);
+        long long reciprocal = ((1LL << BOX_SHIFT) + size - 1) / size;
+        int red = size / 2 + radius * first[0] + (radius - inside) * last[0];
+        int green = size / 2 + radius * first[1] + (radius - inside) * last[1];
+        int blue = size / 2 + radius * first[2] + (radius - inside) * last[2];
+        for (int x = 0; x < inside; x++)
+        {
+            red += scratch[x * 3];
+            green += scratch[x * 3 + 1];
+            blue += scratch[x * 3 + 2];
+        }
+        for (int x = 0; x < width; x++)
+        {
+            const int *add = pixel(x + radius);
+            const int *remove = pixel(x - radius);
+            red += add[0];
+            green += add[1];
+            blue += add[2];
+            row[x * 3] = box_average(red, reciprocal);
+            row[x * 3 + 1] = box_average(green, reciprocal);
+            row[x * 3 + 2] = box_average(blue, reciprocal);
+            red -= remove[0];
+            green -= remove[1];
+            blue -= remove[2];
+        }
+    }
+    else
+    {
+        // Copy the row with the edge pixels repeated radius times either side;
+        // weighted kernels are only used for small radii
+        scratch.resize(static_cast<size_t>(width + 2 * radius) * 3);
+        for (int x = 0; x < radius; x++)
+        {
+            copy(row, row + 3, &scratch[x * 3]);
+            copy(row + (width - 1) * 3, row + width * 3, &scratch[(radius + width + x) * 3]);
+        }
+        copy(row, row + width * 3, &scratch[radius * 3]);
+
+        // Each value of the row is a weighted sum of the values 3 apart in the scratch row
+        int values = width * 3;
+        fill(row, row + values, KERNEL_ONE / 2);
+        for (int k = 0; k < size; k++)
+        {
+            const int *source = &scratch[k * 3];
+            int weight = pass.weights[k];
+            for (int i = 0; i < values; i++)
+            {
+                row[i] += weight * source[i];
+            }
+        }
+        for (int i = 0; i < values; i++)
+        {
+            row[i] >>= KERNEL_SHIFT;
+        }
+    }
+}
+
+/**
+ * Runs one pass down the columns of a band. Rows are combined whole, so the
+ * band is read in memory order.
+ * Helper function for convolve_band()
+ * @param input  the band, as rows of red, green, blue values
+ * @param output the filtered band, the same size as input
+ * @param rows   the number of rows in the band
+ * @param width  the width of the band in pixels
+ * @param pass   the pass
+ */
+static void convolve_columns(const vector<int> &input, vector<int> &output, int rows, int width, const ConvolutionPass &pass)
+{
+    size_t row_values = static_cast<size_t>(width) * 3;
+    auto row = [&](int y)
+    { return &input[min(max(y, 0), rows - 1) * row_values]; };
+
+    int radius = pass.radius;
+    int size = 2 * radius + 1;
+    if (pass.weights.empty())
+    {
+        // Running sum of the rows in the window, which slides down one row at a
+        // time. The first window repeats the top row radius times, and the
+        // bottom row as often as the radius reaches past the band.
+        long long reciprocal = ((1LL << BOX_SHIFT) + size - 1) / size;
+        vector<int> sum(row_values, size / 2);
+        const int *first = row(0);
+        const int *last = row(rows - 1);
+        int inside = min(radius, rows);
+        for (size_t i = 0; i < row_values; i++)
+        {
+            sum[i] += radius * first[i] + (radius - inside) * last[i];
+        }
+        for (int y = 0; y < inside; y++)
+        {
+            const int *add = row(y);
+            for (size_t i = 0; i < row_values; i++)
+            {
+                sum[i] += add[i];
+            }
+        }
+        for (int y = 0; y < rows; y++)
+        {
+            const int *add = row(y + radius);
+            const int *remove = row(y - radius);
+            int *out = &output[y * row_values];
+            for (size_t i = 0; i < row_values; i++)
+            {
+                sum[i] += add[i];
+                out[i] = box_average(sum[i], reciprocal);
+                sum[i] -= remove[i];
+            }
+        }
+    }
+    else
+    {
+        for (int y = 0; y < rows; y++)
+        {
+            int *out = &output[y * row_values];
+            fill(out, out + row_values, KERNEL_ONE / 2);
+            for (int k = 0; k < size; k++)
+            {
+                const int *add = row(y - radius + k);
+                int weight = pass.weights[k];
+                for (size_t i = 0; i < row_values; i++)
+                {
+                    out[i] += weight * add[i];
+                }
+            }
+            for (size_t i = 0; i < row_values; i++)
+            {
+                out[i] >>= KERNEL_SHIFT;
+            }
+        }
+    }
+}
+
+/**
+ * Filters one band of rows and its halo, writing the band's rows to the result
+ * Helper function for convolve()
+ * @param image  the image
+ * @param passes the passes
+ * @param halo   the rows the passes reach above and below a row
+ * @param first  the first row of the band
+ * @param last   one past the last row of the band
+ * @param result the filtered image, filled in place
+ * @param band   working space for the band, reused between bands
+ * @param other  working space for the band, reused between bands
+ */
+static void convolve_band(const vector<vector<Pixel>> &image, const vector<ConvolutionPass> &passes, int halo, int first,
+                          int last, vector<vector<Pixel>> &result, vector<int> &band, vector<int> &other)
+{
+    int width = image[0].size();
+    int top = max(0, first - halo);
+    int rows = min(static_cast<int>(image.size()), last + halo) - top;
+    size_t row_values = static_cast<size_t>(width) * 3;
+    band.resize(rows * row_values);
+    other.resize(rows * row_values);
+
+    // Along the rows
+    vector<int> scratch;
+    for (int y = 0; y < rows; y++)
+    {
+        int *row = &band[y * row_values];
+        for (int x = 0; x < width; x++)
+        {
+            const Pixel &pixel = image[top + y][x];
+            row[x * 3] = pixel.red;
+            row[x * 3 + 1] = pixel.green;
+            row[x * 3 + 2] = pixel.blue;
+        }
+        for (const ConvolutionPass &pass : passes)
+        {
+            convolve_row(row, width, pass, scratch);
+        }
+    }
+
+    // Down the columns. Repeating the halo's outer rows is only wrong within
+    // radius rows of them after each pass, which never reaches the band itself.
+    for (const ConvolutionPass &pass : passes)
+    {
+        convolve_columns(band, other, rows, width, pass);
+        band.swap(other);
+    }
+
+    for (int i = first; i < last; i++)
+    {
+        const int *row = &band[(i - top) * row_values];
+        for (int x = 0; x < width; x++)
+        {
+            result[i][x] = {row[x * 3], row[x * 3 + 1], row[x * 3 + 2]};
+        }
+    }
+}
+
+/**
+ * Applies a separable convolution, band by band across threads
+ * @param image  the image
+ * @param passes the passes, each applied along the rows and down the columns
+ * @return the filtered image
+ */
+vector<vector<Pixel>> convolve(const vector<vector<Pixel>> &image, const vector<ConvolutionPass> &passes)
+{
+    int height = image.size();
+    int width = image[0].size();
+    int halo = 0;
+    for (const ConvolutionPass &pass : passes)
+    {
+        halo += pass.radius;
+    }
+
+    // Bands at least twice the halo keep the rows filtered twice to under half the work
+    int band_rows = max<int>(convolution_band_bytes() / (width * 3 * sizeof(int)), 16);
+    band_rows = max(band_rows, 2 * halo);
+    int bands = (height + band_rows - 1) / band_rows;
+
+    vector<vector<Pixel>> result(height, vector<Pixel>(width));
+    int threads = min(thread_count(), bands);
+    auto filter_bands = [&](int t)
+    {
+        vector<int> band;
+        vector<int> other;
+        for (int b = t; b < bands; b += threads)
+        {
+            convolve_band(image, passes, halo, b * band_rows, min(height, (b + 1) * band_rows), result, band, other);
+        }
+    };
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++)
+    {
+        workers.push_back(thread(filter_bands, t));
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    return result;
+}
+
+/**
+ * Builds the passes of a Gaussian blur. Small blurs use the sampled kernel,
+ * out to three standard deviations. Larger ones use three box passes whose
+ * combined variance matches sigma squared, so their cost stays the same
+ * however large sigma gets.
+ * @param sigma the standard deviation in pixels
+ * @return the passes
+ */
+vector<ConvolutionPass> gaussian_passes(double sigma)
+{
+    if (sigma <= 0)
+    {
+        return {};
+    }
+
+    if (sigma < GAUSSIAN_BOX_SIGMA)
+    {
+        int radius = static_cast<int>(ceil(3 * sigma));
+        vector<double> samples(2 * radius + 1);
+        double total = 0;
+        for (int k = -radius; k <= radius; k++)
+        {
+            samples[k + radius] = exp(-k * k / (2 * sigma * sigma));
+            total += samples[k + radius];
+        }
+
+        // The center takes up the rounding, so the weights sum to exactly KERNEL_ONE
+        ConvolutionPass pass = {radius, vector<int>(2 * radius + 1)};
+        int sum = 0;
+        for (int k = 0; k <= 2 * radius; k++)
+        {
+            pass.weights[k] = static_cast<int>(round(samples[k] / total * KERNEL_ONE));
+            sum += pass.weights[k];
+        }
+        pass.weights[radius] += KERNEL_ONE - sum;
+        return {pass};
+    }
+
+    // Box widths lower and lower + 2, odd, with the narrower used for the first count passes
+    const int n = 3;
+    double variance = 12 * sigma * sigma;
+    int lower = static_cast<int>(floor(sqrt(variance / n + 1)));
+    if (lower % 2 == 0)
+    {
+        lower--;
+    }
+    int count = static_cast<int>(round((variance - n * lower * lower - 4 * n * lower - 3 * n) / (-4.0 * lower - 4)));
+
+    vector<ConvolutionPass> passes;
+    for (int i = 0; i < n; i++)
+    {
+        int size = i < count ? lower : lower + 2;
+        passes.push_back({min((size - 1) / 2, MAX_BOX_RADIUS), {}});
+    }
+    return passes;
+}
+
+// Process 14 - Box blur
+vector<vector<Pixel>> process_box_blur(const vector<vector<Pixel>> &image, int radius)
+{
+    return convolve(image, {{min(max(0, radius), MAX_BOX_RADIUS), {}}});
+}
+
+// Process 15 - Gaussian blur
+vector<vector<Pixel>> process_gaussian_blur(const vector<vector<Pixel>> &image, double sigma)
+{
+    return convolve(image, gaussian_passes(sigma));
+}
+
+// Process 16 - Unsharp mask: adds back amount times the difference from a Gaussian blur
+vector<vector<Pixel>> process_unsharp_mask(const vector<vector<Pixel>> &image, double sigma, double amount)
+{
+    vector<vector<Pixel>> new_image = process_gaussian_blur(image, sigma);
+    for (size_t row = 0; row < image.size(); row++)
+    {
+        for (size_t col = 0; col < image[row].size(); col++)
+        {
+            const Pixel &original = image[row][col];
+            Pixel &blurred = new_image[row][col];
+            blurred.red = min(255, max(0, static_cast<int>(round(original.red + amount * (original.red - blurred.red)))));
+            blurred.green = min(255, max(0, static_cast<int>(round(original.green + amount * (original.green - blurred.green)))));
+            blurred.blue = min(255, max(0, static_cast<int>(round(original.blue + amount * (original.blue - blurred.blue)))));
+        }
+    }
+    return new_image;
+}
+
+// Resampling
+// Resizing to any size runs in two passes: each source row is first resampled
+// to the new width, then the narrowed rows are combined to make each output
+// row. Downscaling therefore never holds more than the source height times
+// the target width between passes. Each output pixel along an axis is a
+// weighted sum of a fixed number of source pixels, and the source positions
+// and Q14 weights are worked out once per column and once per row rather than
+// once per pixel. When shrinking, the filter is widened by the scale factor so
+// that every source pixel contributes. Exact integer downscales with the box
+// filter take a faster path that averages each block of pixels directly.
+const int RESAMPLE_SHIFT = 14;
+const int RESAMPLE_ONE = 1 << RESAMPLE_SHIFT;
+
+namespace
+{
+// Source pixels and weights for each output pixel along one axis
+struct ResampleWeights
+{
+    int taps;            // Source pixels per output pixel
+    vector<int> first;   // First source pixel of each output pixel
+    vector<int> weights; // taps weights for each output pixel, summing to RESAMPLE_ONE
+};
+} // namespace
+
+/**
+ * Evaluates a resampling filter
+ * Helper function for resample_weights()
+ * @param filter the filter
+ * @param x      distance from the center, in source pixels before widening
+ * @return the filter's weight at x
+ */
+static double resample_kernel(ResampleFilter filter, double x)
+{
+    const double pi = 3.14159265358979323846;
+    x = fabs(x);
+    switch (filter)
+    {
+    case RESAMPLE_BOX:
+        return x < 0.5 ? 1.0 : 0.0;
+    case RESAMPLE_BILINEAR:
+        return x < 1.0 ? 1.0 - x : 0.0;
+    default:
+        if (x < 1e-9)
+        {
+            return 1.0;
+        }
+        return x < 3.0 ? 3.0 * sin(pi * x) * sin(pi * x / 3.0) / (pi * pi * x * x) : 0.0;
+    }
+}
+
+/**
+ * Works out the source pixels and weights of each output pixel along one axis
+ * @param source the size of the axis in the source image
+ * @param target the size of the axis in the output image
+ * @param filter the filter
+ * @return the weights
+ */
+static ResampleWeights resample_weights(int source, int target, ResampleFilter filter)
+{
+    const double radius[] = {0.5, 1.0, 3.0};
+    double scale = static_cast<double>(source) / target;
+    double stretch = max(scale, 1.0);
+    double support = radius[filter] * stretch;
+
+    ResampleWeights result;
+    result.taps = min(source, static_cast<int>(ceil(2 * support)) + 1);
+    result.first.resize(target);
+    result.weights.assign(static_cast<size_t>(target) * result.taps, 0);
+
+    vector<double> samples(result.taps);
+    for (int i = 0; i < target; i++)
+    {
+        // Pixel centers sit half a pixel in from their edges
+        double center = (i + 0.5) * scale;
+        int first = static_cast<int>(floor(center - support));
+        first = min(max(first, 0), source - result.taps);
+        result.first[i] = first;
+
+        double total = 0;
+        int nearest = 0;
+        for (int k = 0; k < result.taps; k++)
+        {
+            samples[k] = resample_kernel(filter, (first + k + 0.5 - center) / stretch);
+            total += samples[k];
+            if (fabs(first + k + 0.5 - center) < fabs(first + nearest + 0.5 - center))
+            {
+                nearest = k;
+            }
+        }
+
+        // Source pixels beyond the edges are left out and the rest scaled up to make up for them.
+        // The nearest pixel takes up the rounding, so the weights sum to exactly RESAMPLE_ONE.
+        int *weights = &result.weights[static_cast<size_t>(i) * result.taps];
+        int sum = 0;
+        for (int k = 0; k < result.taps && total != 0; k++)
+        {
+            weights[k] = static_cast<int>(round(samples[k] / total * RESAMPLE_ONE));
+            sum += weights[k];
+        }
+        weights[nearest] += RESAMPLE_ONE - sum;
+    }
+    return result;
+}
+
+/**
+ * Rounds a fixed-point sum of weighted channel values to a channel value
+ * Helper function for the resampling passes
+ * @param sum the sum, with RESAMPLE_SHIFT fractional bits
+ * @return the channel value, clamped to 0-255
+ */
+inline int resample_round(int sum)
+{
+    return min(255, max(0, (sum + RESAMPLE_ONE / 2) >> RESAMPLE_SHIFT));
+}
+
+/**
+ * Runs a function over bands of rows, one band per thread
+ * Helper function for the resampling passes
+ * @param rows the number of rows
+ * @param work the function, given the first row and one past the last row of its band
+ */
+static void for_each_band(int rows, const function<void(int, int)> &work)
+{
+    int threads = min(thread_count(), max(1, rows));
+    int band = (rows + threads - 1) / threads;
+    vector<thread> workers;
+    for (int t = 0; t < threads; ++t)
+    {
+        workers.push_back(thread(work, min(rows, t * band), min(rows, (t + 1) * band)));
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+/**
+ * Shrinks an image by whole factors, averaging each block of pixels
+ * Helper function for process_resize()
+ * @param image   the image
+ * @param x_scale the factor the width shrinks by
+ * @param y_scale the factor the height shrinks by
+ * @return the shrunk image
+ */
+static vector<vector<Pixel>> downscale_area(const vector<vector<Pixel>> &image, int x_scale, int y_scale)
+{
+    int new_height = image.size() / y_scale;
+    int new_width = image[0].size() / x_scale;
+    // A block can cover the whole image, so its sums need more than 32 bits
+    long long count = static_cast<long long>(x_scale) * y_scale;
+    vector<vector<Pixel>> new_image(new_height, vector<Pixel>(new_width));
+
+    for_each_band(new_height, [&](int first, int last)
+                  {
+                      vector<long long> sum(new_width * 3);
+                      for (int row = first; row < last; row++)
+                      {
+                          // Add up the block rows into one sum per output pixel
+                          fill(sum.begin(), sum.end(), count / 2);
+                          for (int i = row * y_scale; i < (row + 1) * y_scale; i++)
+                          {
+                              for (int col = 0; col < new_width * x_scale; col++)
+                              {
+                                  const Pixel &pixel = image[i][col];
+                                  long long *block = &sum[col / x_scale * 3];
+                                  block[0] += pixel.red;
+                                  block[1] += pixel.green;
+                                  block[2] += pixel.blue;
+                              }
+                          }
+                          for (int col = 0; col < new_width; col++)
+                          {
+                              new_image[row][col] = {static_cast<int>(sum[col * 3] / count), static_cast<int>(sum[col * 3 + 1] / count),
+                                                     static_cast<int>(sum[col * 3 + 2] / count)};
+                          }
+                      } });
+    return new_image;
+}
+
+// Process 17 - Resizes the image to any width and height
+vector<vector<Pixel>> process_resize(const vector<vector<Pixel>> &image, int new_width, int new_height,
+                                     ResampleFilter filter)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+    new_width = max(1, new_width);
+    new_height = max(1, new_height);
+    if (new_width == num_columns && new_height == num_rows)
+    {
+        return image;
+    }
+    if (filter == RESAMPLE_BOX && num_columns % new_width == 0 && num_rows % new_height == 0)
+    {
+        return downscale_area(image, num_columns / new_width, num_rows / new_height);
+    }
+
+    ResampleWeights columns = resample_weights(num_columns, new_width, filter);
+    ResampleWeights rows = resample_weights(num_rows, new_height, filter);
+
+    // Resample every source row to the new width
+    size_t row_values = static_cast<size_t>(new_width) * 3;
+    vector<int> narrowed(num_rows * row_values);
+    for_each_band(num_rows, [&](int first, int last)
+                  {
+                      for (int row = first; row < last; row++)
+                      {
+                          int *out = &narrowed[row * row_values];
+                          for (int col = 0; col < new_width; col++)
+                          {
+                              const Pixel *source = &image[row][columns.first[col]];
+                              const int *weights = &columns.weights[static_cast<size_t>(col) * columns.taps];
+                              int red = 0;
+                              int green = 0;
+                              int blue = 0;
+                              for (int k = 0; k < columns.taps; k++)
+                              {
+                                  red += weights[k] * source[k].red;
+                                  green += weights[k] * source[k].green;
+                                  blue += weights[k] * source[k].blue;
+                              }
+                              out[col * 3] = resample_round(red);
+                              out[col * 3 + 1] = resample_round(green);
+                              out[col * 3 + 2] = resample_round(blue);
+                          }
+                      } });
+
+    // Combine the narrowed rows into each output row, whole rows at a time
+    vector<vector<Pixel>> new_image(new_height, vector<Pixel>(new_width));
+    for_each_band(new_height, [&](int first, int last)
+                  {
+                      vector<int> sum(row_values);
+                      for (int row = first; row < last; row++)
+                      {
+                          const int *weights = &rows.weights[static_cast<size_t>(row) * rows.taps];
+                          fill(sum.begin(), sum.end(), 0);
+                          for (int k = 0; k < rows.taps; k++)
+                          {
+                              const int *source = &narrowed[(rows.first[row] + k) * row_values];
+                              int weight = weights[k];
+                              for (size_t i = 0; i < row_values; i++)
+                              {
+                                  sum[i] += weight * source[i];
+                              }
+                          }
+                          for (int col = 0; col < new_width; col++)
+                          {
+                              new_image[row][col] = {resample_round(sum[col * 3]), resample_round(sum[col * 3 + 1]),
+                                                     resample_round(sum[col * 3 + 2])};
+                          }
+                      } });
+    return new_image;
+}
+
+// Fixed-point arithmetic
+// Scaling factors are held as Q32 integers (32 fractional bits) in 64-bit
+// intermediates, so the scaling filters run without any floating point.
+// fixed_truncate() mirrors static_cast<int> by truncating toward zero, and
+// treats a result within the rounding error of the factor as the integer it
+// approximates. Results can still differ from the double filters by at most
+// FIXED_MAX_DEVIATION, where the double product itself misses an exact integer
+// (150 * -0.82 gives -122.99999999999999 and truncates to -122, the fixed-point
+// filter gives -123). verify_fixed_point() measures the actual deviation.
+const int FIXED_SHIFT = 32;
+const long long FIXED_ONE = 1LL << FIXED_SHIFT;
+const long long FIXED_HALF_ONE = 1LL << (FIXED_SHIFT / 2);
+const int FIXED_MAX_DEVIATION = 1;
+
+/**
+ * Converts a scaling factor to Q32 fixed point, rounding to nearest
+ * @param value the scaling factor
+ * @return the scaling factor in fixed point
+ */
+static long long to_fixed(double value)
+{
+    return llround(value * FIXED_ONE);
+}
+
+/**
+ * Truncates a fixed-point value toward zero like static_cast<int>
+ * @param value     the fixed-point value
+ * @param tolerance the rounding error of value, in fixed-point units
+ * @return the integer part of value
+ */
+static int fixed_truncate(long long value, long long tolerance)
+{
+    return static_cast<int>((value >= 0 ? value + tolerance : value - tolerance) / FIXED_ONE);
+}
+
+/**
+ * Fixed-point version of static_cast<int>(value * scaling_factor)
+ * @param value the channel value
+ * @param scale the scaling factor in fixed point
+ * @return the darkened channel value
+ */
+static int fixed_darken(int value, long long scale)
+{
+    return fixed_truncate(value * scale, value / 2 + 1);
+}
+
+/**
+ * Fixed-point version of static_cast<int>(255 - (255 - value) * scaling_factor)
+ * @param value the channel value
+ * @param scale the scaling factor in fixed point
+ * @return the lightened channel value
+ */
+static int fixed_lighten(int value, long long scale)
+{
+    return fixed_truncate(255 * FIXED_ONE - (255 - value) * scale, (255 - value) / 2 + 1);
+}
+
+/**
+ * Square root with 16 fractional bits, rounded down: the integer square root
+ * of n * 2^32. The root is worked out two bits of n * 2^32 at a time, so the
+ * 96-bit product is never formed and the remainder stays below 2^50.
+ * Helper function for process_1_fixed()
+ * @param n the number
+ * @return the largest integer whose square does not exceed n * 2^32
+ */
+static unsigned long long fixed_sqrt(unsigned long long n)
+{
+    unsigned long long root = 0;
+    unsigned long long remainder = 0;
+    for (int pair = 31 + FIXED_SHIFT / 2; pair >= 0; --pair)
+    {
+        // Pairs 0 to 15 are the fractional zero bits of n * 2^32
+        unsigned long long bits = pair >= FIXED_SHIFT / 2 ? (n >> (2 * (pair - FIXED_SHIFT / 2))) & 3 : 0;
+        remainder = (remainder << 2) | bits;
+        root <<= 1;
+        if (remainder >= 2 * root + 1)
+        {
+            remainder -= 2 * root + 1;
+            root |= 1;
+        }
+    }
+    return root;
+}
+
+// Process 1 (fixed point) - vignette effect
+vector<vector<Pixel>> process_1_fixed(const vector<vector<Pixel>> &image)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+
+    // Same integer-truncated center as process_1
+    long long center_row = num_rows / 2;
+    long long center_col = num_columns / 2;
+
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+    for (int row = 0; row < num_rows; ++row)
+    {
+        long long dy = row - center_row;
+        for (int col = 0; col < num_columns; ++col)
+        {
+            long long dx = col - center_col;
+
+            // Distance to the center with 16 fractional bits, rounded down (exact for whole distances)
+            long long distance = fixed_sqrt(dx * dx + dy * dy);
+            long long remaining = num_rows * FIXED_HALF_ONE - distance;
+
+            // The rounded-down distance adds up to value / num_rows in the 17th bit
+            const Pixel &p = image[row][col];
+            int channels[3] = {p.red, p.green, p.blue};
+            int scaled[3];
+            for (int c = 0; c < 3; ++c)
+            {
+                // Divided in two parts so that the product never needs more than 64 bits
+                long long product = channels[c] * remaining;
+                long long value = product / num_rows * FIXED_HALF_ONE + product % num_rows * FIXED_HALF_ONE / num_rows;
+                scaled[c] = fixed_truncate(value, channels[c] * FIXED_HALF_ONE / num_rows + 2);
+            }
+
+            new_image[row][col].red = scaled[0];
+            new_image[row][col].green = scaled[1];
+            new_image[row][col].blue = scaled[2];
+        }
+    }
+
+    return new_image;
+}
+
+// Process 2 (fixed point) - clarendon effect
+vector<vector<Pixel>> process_2_fixed(const vector<vector<Pixel>> &image, double scaling_factor)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+    long long scale = to_fixed(scaling_factor);
+
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (int col = 0; col < num_columns; ++col)
+        {
+            const Pixel &p = image[row][col];
+            int average_value = (p.red + p.green + p.blue) / 3;
+
+            if (average_value >= 170)
+            {
+                new_image[row][col].red = fixed_lighten(p.red, scale);
+                new_image[row][col].green = fixed_lighten(p.green, scale);
+                new_image[row][col].blue = fixed_lighten(p.blue, scale);
+            }
+            else if (average_value < 90)
+            {
+                new_image[row][col].red = fixed_darken(p.red, scale);
+                new_image[row][col].green = fixed_darken(p.green, scale);
+                new_image[row][col].blue = fixed_darken(p.blue, scale);
+            }
+            else
+            {
+                new_image[row][col] = p;
+            }
+        }
+    }
+    return new_image;
+}
+
+// Process 8 (fixed point) - Lightens image by a scaling factor
+vector<vector<Pixel>> process_8_fixed(const vector<vector<Pixel>> &image, double scaling_factor)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+    long long scale = to_fixed(scaling_factor);
+
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (int col = 0; col < num_columns; ++col)
+        {
+            const Pixel &p = image[row][col];
+            new_image[row][col].red = fixed_lighten(p.red, scale);
+            new_image[row][col].green = fixed_lighten(p.green, scale);
+            new_image[row][col].blue = fixed_lighten(p.blue, scale);
+        }
+    }
+
+    return new_image;
+}
+
+// Process 9 (fixed point) - Darkens image by a scaling factor
+vector<vector<Pixel>> process_9_fixed(const vector<vector<Pixel>> &image, double scaling_factor)
+{
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+    long long scale = to_fixed(scaling_factor);
+
+    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (int col = 0; col < num_columns; ++col)
+        {
+            const Pixel &p = image[row][col];
+            new_image[row][col].red = fixed_darken(p.red, scale);
+            new_image[row][col].green = fixed_darken(p.green, scale);
+            new_image[row][col].blue = fixed_darken(p.blue, scale);
+        }
+    }
+
+    return new_image;
+}
+
+/**
+ * Counts the channels that differ between two images of the same size
+ * Helper function for verify_fixed_point()
+ * @param reference  the image from the double filter
+ * @param fixed      the image from the fixed-point filter
+ * @param mismatches running count of differing channels, updated in place
+ * @return the largest absolute channel difference
+ */
+static int channel_deviation(const vector<vector<Pixel>> &reference, const vector<vector<Pixel>> &fixed, long long &mismatches)
+{
+    int deviation = 0;
+    for (size_t row = 0; row < reference.size(); ++row)
+    {
+        for (size_t col = 0; col < reference[row].size(); ++col)
+        {
+            const Pixel &a = reference[row][col];
+            const Pixel &b = fixed[row][col];
+            int diffs[3] = {abs(a.red - b.red), abs(a.green - b.green), abs(a.blue - b.blue)};
+            for (int d : diffs)
+            {
+                if (d != 0)
+                {
+                    mismatches++;
+                    deviation = max(deviation, d);
+                }
+            }
+        }
+    }
+    return deviation;
+}
+
+/**
+ * Prints one line of the fixed-point report
+ * Helper function for verify_fixed_point()
+ * @return true if the deviation is within FIXED_MAX_DEVIATION
+ */
+static bool report_deviation(const string &name, long long checked, long long mismatches, int deviation)
+{
+    cout << name << ": " << checked << " channels checked, " << mismatches
+         << " differ, max deviation " << deviation << endl;
+    return deviation <= FIXED_MAX_DEVIATION;
+}
+
+/**
+ * Exhaustively compares the fixed-point filters against the double filters.
+ * Every input value 0-255 is checked against a grid of scaling factors
+ * from -1.000 to 4.000 in steps of 0.001 for processes 2, 8 and 9, and
+ * against every pixel position of several image sizes for process 1.
+ * @return true if no channel differs by more than FIXED_MAX_DEVIATION
+ */
+bool verify_fixed_point()
+{
+    // One gray pixel per input value, so process_2 also hits all three of its branches
+    vector<vector<Pixel>> ramp(1, vector<Pixel>(256));
+    for (int value = 0; value < 256; ++value)
+    {
+        ramp[0][value] = {value, value, value};
+    }
+
+    long long checked = 0;
+    long long mismatches[3] = {0, 0, 0};
+    int deviation[3] = {0, 0, 0};
+    for (int step = -1000; step <= 4000; ++step)
+    {
+        double scaling_factor = step / 1000.0;
+        deviation[0] = max(deviation[0], channel_deviation(process_2(ramp, scaling_factor), process_2_fixed(ramp, scaling_factor), mismatches[0]));
+        deviation[1] = max(deviation[1], channel_deviation(process_8(ramp, scaling_factor), process_8_fixed(ramp, scaling_factor), mismatches[1]));
+        deviation[2] = max(deviation[2], channel_deviation(process_9(ramp, scaling_factor), process_9_fixed(ramp, scaling_factor), mismatches[2]));
+        checked += 256 * 3;
+    }
+
+    bool passed = true;
+    passed = report_deviation("Clarendon (process_2)", checked, mismatches[0], deviation[0]) && passed;
+    passed = report_deviation("Lighten (process_8)", checked, mismatches[1], deviation[1]) && passed;
+    passed = report_deviation("Darken (process_9)", checked, mismatches[2], deviation[2]) && passed;
+
+    // Each size is run once per input value so every position's factor sees all 256 inputs
+    const int sizes[][2] = {{1, 1}, {2, 3}, {5, 17}, {64, 64}, {37, 101}, {500, 33}, {255, 256}};
+    long long vignette_checked = 0;
+    long long vignette_mismatches = 0;
+    int vignette_deviation = 0;
+    for (const auto &size : sizes)
+    {
+        vector<vector<Pixel>> image(size[0], vector<Pixel>(size[1]));
+        for (int value = 0; value < 256; ++value)
+        {
+            for (auto &row : image)
+            {
+                for (auto &p : row)
+                {
+                    p = {value, (value + 85) % 256, (value + 170) % 256};
+                }
+            }
+            vignette_deviation = max(vignette_deviation, channel_deviation(process_1(image), process_1_fixed(image), vignette_mismatches));
+            vignette_checked += 3LL * size[0] * size[1];
+        }
+    }
+    passed = report_deviation("Vignette (process_1)", vignette_checked, vignette_mismatches, vignette_deviation) && passed;
+
+    cout << (passed ? "Fixed-point verification passed" : "Fixed-point verification FAILED") << endl;
+    return passed;
+}
+
+// Operation chains
+// Non-interactive modes describe their filters as a chain of menu numbers
+// separated by commas, each followed by its parameters after colons, e.g.
+// "3,9:0.5,6:2:2" is grayscale, darken by 0.5, then enlarge 2x in each direction.
+const int MAX_ENLARGE_SCALE = 64;    // Largest factor of process 6 in each direction
+const int MAX_RESIZE_SIDE = 1 << 20; // Largest width or height process 17 resizes to
+const int MAX_ROTATIONS = 1 << 30;   // Largest rotation count of process 5
+
+/**
+ * Checks that an operation names a process and has the parameters it takes
+ * @param operation the operation
+ * @return false if the process does not exist or a parameter is missing, extra or out of range:
+ *         rotations below 0, enlarge scales outside 1 to MAX_ENLARGE_SCALE, blur radii and
+ *         sigmas that are not positive, or resize sides outside 1 to MAX_RESIZE_SIDE
+ */
+bool operation_valid(const Operation &operation)
+{
+    // Number of parameters each process takes (process 7 takes an optional threshold)
+    // (process 17 takes an optional filter)
+    const int min_params[] = {0, 0, 1, 0, 0, 1, 2, 0, 1, 1, 0, 0, 0, 0, 1, 1, 2, 2};
+    const int max_params[] = {0, 0, 1, 0, 0, 1, 2, 1, 1, 1, 0, 0, 0, 0, 1, 1, 2, 3};
+
+    int count = operation.params.size();
+    if (operation.process < 1 || operation.process > 17 ||
+        count < min_params[operation.process] || count > max_params[operation.process])
+    {
+        return false;
+    }
+
+    // Ranges are checked as "not inside" so that NaN parameters fail too
+    const vector<double> &params = operation.params;
+    switch (operation.process)
+    {
+    case 5:
+        return params[0] >= 0 && params[0] <= MAX_ROTATIONS;
+    case 6:
+        return params[0] >= 1 && params[0] <= MAX_ENLARGE_SCALE && params[1] >= 1 && params[1] <= MAX_ENLARGE_SCALE;
+    case 14:
+        return params[0] >= 1 && params[0] <= MAX_BOX_RADIUS;
+    case 15:
+        return params[0] > 0 && params[0] <= MAX_BOX_RADIUS;
+    case 16:
+        return params[0] > 0 && params[0] <= MAX_BOX_RADIUS && isfinite(params[1]);
+    case 17:
+        return params[0] >= 1 && params[0] <= MAX_RESIZE_SIDE && params[1] >= 1 && params[1] <= MAX_RESIZE_SIDE &&
+               (count < 3 || (params[2] >= RESAMPLE_BOX && params[2] <= RESAMPLE_LANCZOS));
+    default:
+        return true;
+    }
+}
+
+/**
+ * Parses an operation chain
+ * @param spec       the chain, e.g. "3,9:0.5"
+ * @param operations the parsed steps, filled in place
+ * @return false if the chain is malformed or a step has the wrong parameters
+ */
+bool parse_operations(const string &spec, vector<Operation> &operations)
+{
+    operations.clear();
+    istringstream steps(spec);
+    string step;
+    while (getline(steps, step, ','))
+    {
+        istringstream fields(step);
+        string field;
+        Operation operation;
+        if (!getline(fields, field, ':'))
+        {
+            return false;
+        }
+        try
+        {
+            operation.process = stoi(field);
+            while (getline(fields, field, ':'))
+            {
+                operation.params.push_back(stod(field));
+            }
+        }
+        catch (const exception &)
+        {
+            return false;
+        }
+
+        if (!operation_valid(operation))
+        {
+            return false;
+        }
+        operations.push_back(operation);
+    }
+    return !operations.empty();
+}
+
+/**
+ * Whether an operation depends on nothing but each pixel's color
+ * @param operation the operation
+ * @return true for the color filters, false for vignette, the geometric processes and the blurs
+ */
+bool operation_color_only(const Operation &operation)
+{
+    return operation.process != 1 && (operation.process < 4 || operation.process > 6) && operation.process < 14;
+}
+
+/**
+ * Builds the filter for one step of an operation chain
+ * @param operation   the operation
+ * @param stats       statistics of the input image, used by the automatic processes
+ * @param fixed_point whether to use the fixed-point scaling filters
+ * @return the filter
+ */
+Filter operation_filter(const Operation &operation, const ImageStats &stats, bool fixed_point)
+{
+    const vector<double> &params = operation.params;
+    switch (operation.process)
+    {
+    case 1:
+        return fixed_point ? Filter(process_1_fixed) : Filter(process_1);
+    case 2:
+        return [params, fixed_point](const vector<vector<Pixel>> &image)
+        { return fixed_point ? process_2_fixed(image, params[0]) : process_2(image, params[0]); };
+    case 3:
+        return process_3;
+    case 4:
+        return process_4;
+    case 5:
+        return [params](const vector<vector<Pixel>> &image)
+        { return process_5(image, static_cast<int>(params[0])); };
+    case 6:
+        return [params](const vector<vector<Pixel>> &image)
+        { return process_6(image, static_cast<int>(params[0]), static_cast<int>(params[1])); };
+    case 7:
+        return [params](const vector<vector<Pixel>> &image)
+        { return process_7(image, params.empty() ? 255 / 2 : static_cast<int>(params[0])); };
+    case 8:
+        return [params, fixed_point](const vector<vector<Pixel>> &image)
+        { return fixed_point ? process_8_fixed(image, params[0]) : process_8(image, params[0]); };
+    case 9:
+        return [params, fixed_point](const vector<vector<Pixel>> &image)
+        { return fixed_point ? process_9_fixed(image, params[0]) : process_9(image, params[0]); };
+    case 10:
+        return process_10;
+    case 11:
+        return [stats](const vector<vector<Pixel>> &image)
+        { return process_auto_levels(image, stats); };
+    case 12:
+        return [stats](const vector<vector<Pixel>> &image)
+        { return process_2_auto(image, stats); };
+    case 13:
+        return [stats](const vector<vector<Pixel>> &image)
+        { return process_7_auto(image, stats); };
+    case 14:
+        return [params](const vector<vector<Pixel>> &image)
+        { return process_box_blur(image, static_cast<int>(params[0])); };
+    case 15:
+        return [params](const vector<vector<Pixel>> &image)
+        { return process_gaussian_blur(image, params[0]); };
+    case 16:
+        return [params](const vector<vector<Pixel>> &image)
+        { return process_unsharp_mask(image, params[0], params[1]); };
+    default:
+        return [params](const vector<vector<Pixel>> &image)
+        {
+            ResampleFilter filter = params.size() > 2 ? static_cast<ResampleFilter>(static_cast<int>(params[2])) : RESAMPLE_LANCZOS;
+            return process_resize(image, static_cast<int>(params[0]), static_cast<int>(params[1]), filter);
+        };
+    }
+}
+
+/**
+ * Runs an image through an operation chain
+ * @param image       the image
+ * @param operations  the chain
+ * @param stats       statistics of the input image, used by the automatic processes
+ * @param fixed_point whether to use the fixed-point scaling filters
+ * @return the filtered image
+ */
+vector<vector<Pixel>> apply_operations(vector<vector<Pixel>> image, const vector<Operation> &operations,
+                                       const ImageStats &stats, bool fixed_point)
+{
+    for (const Operation &operation : operations)
+    {
+        image = operation_filter(operation, stats, fixed_point)(image);
+    }
+    return image;
+}
+
+/**
+ * Runs the palette of an indexed image through a chain of color filters,
+ * keeping its indices, so the image can be written palettized again
+ * @param indexed     the image, whose palette is replaced
+ * @param operations  the chain
+ * @param fixed_point whether to use the fixed-point scaling filters
+ * @return false, leaving the image untouched, if a step is not a color filter
+ */
+bool apply_operations_indexed(IndexedImage &indexed, const vector<Operation> &operations, bool fixed_point)
+{
+    if (!all_of(operations.begin(), operations.end(), operation_color_only))
+    {
+        return false;
+    }
+    ImageStats stats;
+    indexed_stats(indexed, stats);
+    indexed.palette = apply_operations(vector<vector<Pixel>>(1, indexed.palette), operations, stats, fixed_point)[0];
+    return true;
+}
+
+/**
+ * Works out the size of an image after each step of an operation chain
+ * @param operation the operation
+ * @param width     the width, updated in place
+ * @param height    the height, updated in place
+ */
+void operation_size(const Operation &operation, int &width, int &height)
+{
+    if (operation.process == 4 || (operation.process == 5 && (static_cast<int>(operation.params[0]) % 4 + 4) % 4 % 2 == 1))
+    {
+        swap(width, height);
+    }
+    else if (operation.process == 6)
+    {
+        width *= static_cast<int>(operation.params[0]);
+        height *= static_cast<int>(operation.params[1]);
+    }
+    else if (operation.process == 17)
+    {
+        width = static_cast<int>(operation.params[0]);
+        height = static_cast<int>(operation.params[1]);
+    }
+}
+
+
+// Tile pyramid
+// A deep-zoom viewer shows a giant image as square tiles at a series of
+// levels, each half the size of the one before. The pyramid is built in one
+// pass over the pixel array. As in Deep Zoom, levels are numbered from the
+// 1x1 image at level 0 up to the full image; build.levels holds them the
+// other way round, full image first. Each level collects one row of tiles at a time;
+// when the row is complete its tiles are written and its rows are averaged in
+// pairs, 2x2 pixels at a time, into the next level. Rows arrive from the
+// bottom of the image up, as BMP files store them, so no level ever holds
+// more than a row of tiles and one unpaired row.
+
+namespace
+{
+// One level of a tile pyramid while it is being built
+struct PyramidLevel
+{
+    int width;
+    int height;
+    vector<vector<Pixel>> band; // Rows of the row of tiles being filled
+    int band_rows;              // Rows of the band received so far
+    vector<Pixel> pending;      // A row waiting for the other row of its pair
+    int pending_row;            // Index of that row, or -1
+};
+
+// State of a pyramid build
+struct PyramidBuild
+{
+    const PyramidConfig &config;
+    vector<Filter> filters; // Color filters, applied to each band of level 0
+    vector<PyramidLevel> levels; // Full image first, so levels[0] is the highest level
+};
+} // namespace
+
+/**
+ * Averages a pair of rows, and each pair of pixels along them, into one row half the size
+ * Helper function for add_pyramid_row()
+ * @param row   one row of the pair
+ * @param other the other row, or nullptr for the last row of an image with an odd height
+ * @return the averaged row
+ */
+static vector<Pixel> halve_rows(const vector<Pixel> &row, const vector<Pixel> *other)
+{
+    int width = row.size();
+    vector<Pixel> halved((width + 1) / 2);
+    for (int col = 0; col < width; col += 2)
+    {
+        int count = 0;
+        int red = 0, green = 0, blue = 0;
+        for (const vector<Pixel> *pair : {&row, other})
+        {
+            for (int x = col; pair && x < min(col + 2, width); ++x)
+            {
+                red += (*pair)[x].red;
+                green += (*pair)[x].green;
+                blue += (*pair)[x].blue;
+                ++count;
+            }
+        }
+        halved[col / 2] = {(red + count / 2) / count, (green + count / 2) / count, (blue + count / 2) / count};
+    }
+    return halved;
+}
+
+/**
+ * Writes the tiles of a complete band of one level
+ * Helper function for add_pyramid_row()
+ * @param build the pyramid build
+ * @param level the level
+ * @param band  the index of the band, which is the row of the tiles
+ * @return false if a tile could not be written
+ */
+static bool write_pyramid_band(const PyramidBuild &build, int level, int band)
+{
+    const PyramidLevel &current = build.levels[level];
+    int tile_size = build.config.tile_size;
+    for (int col = 0; col * tile_size < current.width; ++col)
+    {
+        int first = col * tile_size;
+        int width = min(tile_size, current.width - first);
+        vector<vector<Pixel>> tile(current.band.size());
+        for (size_t row = 0; row < tile.size(); ++row)
+        {
+            tile[row].assign(current.band[row].begin() + first, current.band[row].begin() + first + width);
+        }
+        int number = build.levels.size() - 1 - level;
+        string filename = build.config.directory + "/" + to_string(number) + "/" + to_string(col) + "_" + to_string(band) + ".bmp";
+        if (!write_image(filename, tile, build.config.format))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Adds a row to a level of the pyramid. A row that completes a band writes
+ * the band's tiles and passes its rows on to the next level.
+ * @param build  the pyramid build
+ * @param level  the level
+ * @param row    the index of the row, from the top of the level
+ * @param pixels the pixels of the row, moved from
+ * @return false if a tile could not be written
+ */
+static bool add_pyramid_row(PyramidBuild &build, int level, int row, vector<Pixel> &pixels)
+{
+    PyramidLevel &current = build.levels[level];
+    int tile_size = build.config.tile_size;
+    int band = row / tile_size;
+    int first = band * tile_size;
+    int rows = min(tile_size, current.height - first);
+    if (current.band_rows == 0)
+    {
+        current.band.resize(rows);
+    }
+    current.band[row - first].swap(pixels);
+    if (++current.band_rows < rows)
+    {
+        return true;
+    }
+
+    // The band is complete
+    for (size_t i = 0; level == 0 && i < build.filters.size(); ++i)
+    {
+        current.band = build.filters[i](current.band);
+    }
+    if (!write_pyramid_band(build, level, band))
+    {
+        return false;
+    }
+    if (level + 1 < static_cast<int>(build.levels.size()))
+    {
+        for (int i = rows - 1; i >= 0; --i)
+        {
+            int index = first + i;
+            vector<Pixel> halved;
+            if (current.pending_row >= 0 && current.pending_row / 2 == index / 2)
+            {
+                halved = halve_rows(current.band[i], &current.pending);
+                current.pending_row = -1;
+            }
+            else if (index == current.height - 1 && index % 2 == 0)
+            {
+                halved = halve_rows(current.band[i], nullptr);
+            }
+            else
+            {
+                current.pending.swap(current.band[i]);
+                current.pending_row = index;
+                continue;
+            }
+            if (!add_pyramid_row(build, level + 1, index / 2, halved))
+            {
+                return false;
+            }
+        }
+    }
+    current.band.clear();
+    current.band_rows = 0;
+    return true;
+}
+
+/**
+ * Reads the headers of a 24 or 32-bit BMP from a stream and skips to its pixel array
+ * Helper function for write_pyramid() and apply_operations_streaming()
+ * @param file the stream, at the start of the BMP
+ * @param info the header fields, filled in place
+ * @return false if the stream does not hold a 24 or 32-bit image
+ */
+static bool open_pixel_array(FILE *file, BmpInfo &info)
+{
+    unsigned char header[BMP_INFO_BYTES];
+    return read_stream_bytes(file, header, BMP_INFO_BYTES) && parse_bmp_info(header, info) && info.bits_per_pixel >= 24 &&
+           info.start >= BMP_INFO_BYTES && read_stream_bytes(file, nullptr, info.start - BMP_INFO_BYTES);
+}
+
+/**
+ * Whether an operation can be applied while a pyramid is built
+ * @param operation the operation
+ * @return true for the color filters that do not need the image statistics
+ */
+bool operation_pyramid(const Operation &operation)
+{
+    return operation_color_only(operation) && (operation.process < 11 || operation.process > 13);
+}
+
+/**
+ * Builds a deep-zoom tile pyramid from a 24 or 32-bit BMP in one pass over
+ * the stream. Levels are numbered as Deep Zoom does: level 0 is a single
+ * pixel, each level doubles the one below it, and level levels - 1 is the
+ * full image. The tiles of each level are written as
+ * <directory>/<level>/<column>_<row>.bmp, with the level directories created
+ * on Linux and expected to exist elsewhere.
+ * @param file   the stream, e.g. stdin, at the start of the BMP
+ * @param config the pyramid settings
+ * @param levels the number of levels, set in place
+ * @return false if the stream does not hold a 24 or 32-bit image, an operation
+ *         is not a color filter, or a tile could not be written
+ */
+bool write_pyramid(FILE *file, const PyramidConfig &config, int &levels)
+{
+    BmpInfo info;
+    if (config.tile_size < 2 || config.tile_size % 2 != 0 || !open_pixel_array(file, info))
+    {
+        return false;
+    }
+
+    PyramidBuild build = {config, {}, {}};
+    for (const Operation &operation : config.operations)
+    {
+        if (!operation_pyramid(operation))
+        {
+            return false;
+        }
+        build.filters.push_back(operation_filter(operation, ImageStats(), config.fixed_point));
+    }
+    for (int width = info.width, height = info.height;; width = (width + 1) / 2, height = (height + 1) / 2)
+    {
+        build.levels.push_back({width, height, {}, 0, {}, -1});
+        if (width == 1 && height == 1)
+        {
+            break;
+        }
+    }
+    levels = build.levels.size();
+#ifdef __linux__
+    for (int level = 0; level < levels; ++level)
+    {
+        mkdir((config.directory + "/" + to_string(level)).c_str(), 0755);
+    }
+#endif
+
+    vector<unsigned char> scanline(info.row_bytes);
+    vector<Pixel> pixels;
+    for (int row = info.height - 1; row >= 0; --row)
+    {
+        pixels.resize(info.width);
+        if (!read_scanline(file, info, scanline, pixels, nullptr))
+        {
+            return false;
+        }
+        if (!add_pyramid_row(build, 0, row, pixels))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Memory budget
+// Jobs that run side by side can share a fixed amount of memory. Before a
+// job starts, its peak is estimated from the BMP header and its operation
+// chain, following what the readers, filters and writers allocate, and the
+// job waits until that much of the budget is free. A chain of color filters
+// too big for the budget can instead stream the image through in bands of
+// rows, which needs only a few megabytes whatever the image size.
+const size_t STREAMING_BAND_BYTES = 4 << 20; // Decoded pixels in one band of a streamed job
+
+/**
+ * Memory held by an image of the given size as a vector of vector of Pixels
+ * @param width  the width in pixels
+ * @param height the height in pixels
+ * @return the size in bytes
+ */
+static long long image_bytes(long long width, long long height)
+{
+    return height * static_cast<long long>(sizeof(vector<Pixel>) + width * sizeof(Pixel));
+}
+
+/**
+ * Estimates the most memory that reading an image, running it through an
+ * operation chain and writing the result holds at any one time
+ * @param info       the header fields of the input
+ * @param operations the chain
+ * @param format     the output format
+ * @return the estimate in bytes
+ */
+long long estimate_peak_bytes(const BmpInfo &info, const vector<Operation> &operations, BmpFormat format)
+{
+    long long width = info.width;
+    long long height = info.height;
+    long long pixels = width * height;
+
+    // The reader holds the whole pixel array, or the palette indices, next to the decoded image
+    long long array_bytes = info.bits_per_pixel <= 8 ? pixels : static_cast<long long>(info.row_bytes) * height;
+    long long peak = array_bytes + image_bytes(width, height);
+
+    // Each step holds its input and its output, and some steps more besides
+    for (const Operation &operation : operations)
+    {
+        int new_width = width;
+        int new_height = height;
+        operation_size(operation, new_width, new_height);
+        long long step = image_bytes(width, height) + image_bytes(new_width, new_height);
+        if (operation.process == 5)
+        {
+            step += image_bytes(width, height); // A copy of the input, rotated in turn
+        }
+        else if (operation.process >= 14 && operation.process <= 16)
+        {
+            step += 2LL * thread_count() * convolution_band_bytes(); // Each band and its halo, in and out
+        }
+        else if (operation.process == 17)
+        {
+            step += static_cast<long long>(new_width) * height * 3 * sizeof(int); // Rows resampled to the new width
+        }
+        peak = max(peak, step);
+        width = new_width;
+        height = new_height;
+    }
+
+    // An indexed output is mapped to palette indices and encoded before it is written
+    if (format != BMP_RGB24)
+    {
+        peak = max(peak, image_bytes(width, height) + 2 * width * height);
+    }
+    return peak;
+}
+
+/**
+ * Whether an operation chain can stream an image through in bands of rows
+ * @param operations the chain
+ * @return true if every step is a color filter
+ */
+bool operations_streamable(const vector<Operation> &operations)
+{
+    for (const Operation &operation : operations)
+    {
+        if (!operation_color_only(operation))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Rows in each band of a streamed job
+ * @param width the image width in pixels
+ * @return the number of rows
+ */
+static int streaming_band_rows(int width)
+{
+    return max(1, static_cast<int>(STREAMING_BAND_BYTES / (max(1, width) * sizeof(Pixel))));
+}
+
+/**
+ * Estimates the most memory apply_operations_streaming() holds at any one time
+ * @param info the header fields of the input
+ * @return the estimate in bytes
+ */
+long long estimate_streaming_bytes(const BmpInfo &info)
+{
+    int rows = min(streaming_band_rows(info.width), info.height);
+    long long output_row_bytes = (info.width * 3LL + 3) / 4 * 4;
+    return 2 * image_bytes(info.width, rows) + output_row_bytes + info.row_bytes;
+}
+
+/**
+ * Runs a 24 or 32-bit BMP through a chain of color filters in bands of rows,
+ * reading and writing each band before the next, and writes a 24-bit BMP.
+ * A chain with automatic filters reads the image twice, the first time for
+ * its statistics.
+ * @param input_filename  BMP image filename
+ * @param output_filename where the result goes
+ * @param operations      the chain
+ * @param fixed_point     whether to use the fixed-point scaling filters
+ * @return false if the input could not be read, the output could not be
+ *         written, or the chain is not all color filters
+ */
+bool apply_operations_streaming(string input_filename, string output_filename, const vector<Operation> &operations,
+                                bool fixed_point)
+{
+    FILE *input = operations_streamable(operations) ? fopen(input_filename.c_str(), "rb") : nullptr;
+    if (!input)
+    {
+        return false;
+    }
+    BmpInfo info;
+    bool read = open_pixel_array(input, info);
+    vector<unsigned char> scanline(read ? info.row_bytes : 0);
+
+    ImageStats stats = ImageStats();
+    bool needs_stats = false;
+    for (const Operation &operation : operations)
+    {
+        needs_stats = needs_stats || (operation.process >= 11 && operation.process <= 13);
+    }
+    if (read && needs_stats)
+    {
+        vector<Pixel> row(info.width);
+        for (int i = 0; read && i < info.height; i++)
+        {
+            read = read_scanline(input, info, scanline, row, &stats);
+        }
+        finish_stats(stats);
+        read = read && fseek(input, info.start, SEEK_SET) == 0;
+    }
+    FILE *output = read ? fopen(output_filename.c_str(), "wb") : nullptr;
+    if (!output)
+    {
+        fclose(input);
+        return false;
+    }
+
+    vector<Filter> filters;
+    for (const Operation &operation : operations)
+    {
+        filters.push_back(operation_filter(operation, stats, fixed_point));
+    }
+
+    int row_bytes = (info.width * 3 + 3) / 4 * 4;
+    unsigned char header[BMP_INFO_BYTES] = {0};
+    set_bmp_headers(header, info.width, info.height, 24, 0, 0, row_bytes * info.height);
+    bool written = fwrite(header, 1, sizeof(header), output) == sizeof(header);
+
+    // Bands are taken in file order, from the bottom of the image up, which the color filters do not mind
+    int band_rows = streaming_band_rows(info.width);
+    vector<unsigned char> out_row(row_bytes, 0);
+    for (int first = 0; written && first < info.height; first += band_rows)
+    {
+        vector<vector<Pixel>> band(min(band_rows, info.height - first), vector<Pixel>(info.width));
+        for (vector<Pixel> &row : band)
+        {
+            written = written && read_scanline(input, info, scanline, row, nullptr);
+        }
+        if (!written)
+        {
+            break;
+        }
+        for (const Filter &filter : filters)
+        {
+            band = filter(band);
+        }
+        for (size_t i = 0; written && i < band.size(); i++)
+        {
+            unsigned char *pixel = out_row.data();
+            for (const Pixel &p : band[i])
+            {
+                pixel[0] = p.blue;
+                pixel[1] = p.green;
+                pixel[2] = p.red;
+                pixel += 3;
+            }
+            written = fwrite(out_row.data(), 1, out_row.size(), output) == out_row.size();
+        }
+    }
+    fclose(input);
+    return fclose(output) == 0 && written;
+}
+
+/**
+ * Creates a budget
+ * @param bytes the memory the budget shares out
+ */
+MemoryBudget::MemoryBudget(long long bytes) : total(max(1LL, bytes)), used(0), next_ticket(0), serving(0) {}
+
+/**
+ * Reserves memory, waiting until it is free. Callers are admitted in the
+ * order they arrive, so a large reservation is not starved by small ones.
+ * @param bytes the memory wanted. More than the whole budget reserves all
+ *              of it, which runs the caller alone
+ * @return the memory reserved, to hand back to release()
+ */
+long long MemoryBudget::acquire(long long bytes)
+{
+    bytes = min(max(0LL, bytes), total);
+    unique_lock<mutex> lock(guard);
+    long long ticket = next_ticket++;
+    released.wait(lock, [&]
+                  { return ticket == serving && used + bytes <= total; });
+    used += bytes;
+    serving++;
+    released.notify_all();
+    return bytes;
+}
+
+/**
+ * Hands back memory reserved by acquire()
+ * @param bytes the memory acquire() returned
+ */
+void MemoryBudget::release(long long bytes)
+{
+    lock_guard<mutex> lock(guard);
+    used -= bytes;
+    released.notify_all();
+}
+
+/**
+ * The memory the budget shares out
+ * @return the size in bytes
+ */
+long long MemoryBudget::limit() const
+{
+    return total;
+}
+
+// Job API
+// Embedders hand over pixels in their own memory rather than BMP files. A job
+// copies its input buffer into an image, runs the chain on it and copies the
+// result out, so the buffers only have to stay valid while the job runs.
+
+/**
+ * Offsets of red, green and blue within a pixel, and the pixel size, for a layout
+ * Helper function for buffer_to_image() and image_to_buffer()
+ * @param layout the layout
+ * @param red    offset of red, set in place
+ * @param blue   offset of blue, set in place
+ * @return bytes per pixel
+ */
+static int layout_offsets(PixelLayout layout, int &red, int &blue)
+{
+    bool bgr = layout == LAYOUT_BGR24 || layout == LAYOUT_BGRA32;
+    red = bgr ? 2 : 0;
+    blue = bgr ? 0 : 2;
+    return layout == LAYOUT_RGBA32 || layout == LAYOUT_BGRA32 ? 4 : 3;
+}
+
+/**
+ * Copies a caller's buffer into an image
+ * Helper function for run_job()
+ * @param buffer the buffer
+ * @param stats  if not nullptr, filled with the statistics of the image
+ * @return the image as a vector of vector of Pixels
+ */
+static vector<vector<Pixel>> buffer_to_image(const PixelBuffer &buffer, ImageStats *stats)
+{
+    int red, blue;
+    int pixel_bytes = layout_offsets(buffer.layout, red, blue);
+    if (stats)
+    {
+        *stats = ImageStats();
+    }
+
+    vector<vector<Pixel>> image(buffer.height, vector<Pixel>(buffer.width));
+    for (int row = 0; row < buffer.height; ++row)
+    {
+        const unsigned char *data = buffer.data + row * buffer.stride;
+        for (int col = 0; col < buffer.width; ++col, data += pixel_bytes)
+        {
+            Pixel &p = image[row][col];
+            p.red = data[red];
+            p.green = data[1];
+            p.blue = data[blue];
+            if (stats)
+            {
+                add_to_stats(*stats, p);
+            }
+        }
+    }
+    if (stats)
+    {
+        finish_stats(*stats);
+    }
+    return image;
+}
+
+/**
+ * Copies an image into a caller's buffer of the same size.
+ * Channel values are taken modulo 256, as write_image() stores them.
+ * Helper function for run_job()
+ * @param image  the image
+ * @param buffer the buffer, written in place
+ */
+static void image_to_buffer(const vector<vector<Pixel>> &image, const PixelBuffer &buffer)
+{
+    int red, blue;
+    int pixel_bytes = layout_offsets(buffer.layout, red, blue);
+    for (int row = 0; row < buffer.height; ++row)
+    {
+        unsigned char *data = buffer.data + row * buffer.stride;
+        for (int col = 0; col < buffer.width; ++col, data += pixel_bytes)
+        {
+            const Pixel &p = image[row][col];
+            data[red] = static_cast<unsigned char>(p.red);
+            data[1] = static_cast<unsigned char>(p.green);
+            data[blue] = static_cast<unsigned char>(p.blue);
+            if (pixel_bytes == 4)
+            {
+                data[3] = 255;
+            }
+        }
+    }
+}
+
+/**
+ * Works out the size of an image after a whole operation chain
+ * @param operations the chain
+ * @param width      the input width, updated in place
+ * @param height     the input height, updated in place
+ */
+void chain_output_size(const vector<Operation> &operations, int &width, int &height)
+{
+    for (const Operation &operation : operations)
+    {
+        operation_size(operation, width, height);
+    }
+}
+
+/**
+ * Whether a job has been cancelled
+ * Helper function for run_job()
+ * @param job the job
+ * @return true once the job's cancel flag is set
+ */
+static bool job_cancelled(const Job &job)
+{
+    return job.cancel && job.cancel->load();
+}
+
+/**
+ * Runs a job on the calling thread
+ * @param job the job
+ * @return JOB_DONE once the output buffer holds the result, JOB_CANCELLED if the
+ *         cancel flag was set before the last step finished, JOB_FAILED if the
+ *         chain is invalid or the output buffer has the wrong size
+ */
+JobStatus run_job(const Job &job)
+{
+    if (!job.input.data || !job.output.data || job.input.width < 1 || job.input.height < 1)
+    {
+        return JOB_FAILED;
+    }
+    for (const Operation &operation : job.operations)
+    {
+        if (!operation_valid(operation))
+        {
+            return JOB_FAILED;
+        }
+    }
+    int width = job.input.width;
+    int height = job.input.height;
+    chain_output_size(job.operations, width, height);
+    if (job.output.width != width || job.output.height != height)
+    {
+        return JOB_FAILED;
+    }
+    if (job_cancelled(job))
+    {
+        return JOB_CANCELLED;
+    }
+
+    // Only the automatic processes read the statistics
+    bool needs_stats = false;
+    for (const Operation &operation : job.operations)
+    {
+        needs_stats = needs_stats || (operation.process >= 11 && operation.process <= 13);
+    }
+    ImageStats stats = ImageStats();
+    vector<vector<Pixel>> image = buffer_to_image(job.input, needs_stats ? &stats : nullptr);
+
+    for (const Operation &operation : job.operations)
+    {
+        if (job_cancelled(job))
+        {
+            return JOB_CANCELLED;
+        }
+        image = operation_filter(operation, stats, job.fixed_point)(image);
+    }
+    if (job_cancelled(job))
+    {
+        return JOB_CANCELLED;
+    }
+    image_to_buffer(image, job.output);
+    return JOB_DONE;
+}
+
+/**
+ * Starts a pool of worker threads. The jobs run their filters on one thread
+ * each, so the pool never uses more threads than it has workers.
+ * @param threads    the number of workers, or 0 for one per core
+ * @param queue_size the number of jobs that can wait before submit() blocks
+ */
+Processor::Processor(int threads, size_t queue_size) : queue(queue_size)
+{
+    if (threads < 1)
+    {
+        threads = thread_count();
+    }
+    for (int i = 0; i < threads; ++i)
+    {
+        workers.emplace_back([this]
+                             {
+                                 set_thread_limit(1); // Each job runs its filters on this thread alone
+                                 shared_ptr<packaged_task<JobStatus()>> task;
+                                 while (queue.pop(task))
+                                 {
+                                     (*task)();
+                                 } });
+    }
+}
+
+// Finishes the queued jobs and stops the workers
+Processor::~Processor()
+{
+    queue.close();
+    for (thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+/**
+ * Queues a job, waiting while the queue is full
+ * @param job the job. Its buffers must stay valid until the future is ready
+ * @return the future status of the job
+ */
+future<JobStatus> Processor::submit(const Job &job)
+{
+    shared_ptr<packaged_task<JobStatus()>> task = make_shared<packaged_task<JobStatus()>>([job]
+                                                                                         { return run_job(job); });
+    future<JobStatus> status = task->get_future();
+    queue.push(task);
+    return status;
+}
+
+// Auto-tuning
+// The fastest thread count, convolution band size and rotation block size
+// differ between machines. The tuner times the decoder, a blur, the rotation,
+// a point filter and the writer on a synthetic image for each candidate, and
+// keeps the fastest. The result is saved as a profile for the host, with the
+// CPU model it was measured on so that a profile from other hardware can be
+// told apart.
+const int TUNING_WIDTH = 1536;
+const int TUNING_HEIGHT = 1024;
+const int TUNING_RUNS = 3; // Each candidate is timed this many times and the fastest run kept
+
+/**
+ * Returns the settings in use
+ * @return the profile
+ */
+const TuningProfile &current_tuning()
+{
+    return tuning;
+}
+
+/**
+ * Replaces the settings in use. Call before starting any threads.
+ * @param profile the profile
+ */
+void set_tuning(const TuningProfile &profile)
+{
+    tuning = profile;
+}
+
+/**
+ * Returns the model name of the CPU
+ * @return the model name from /proc/cpuinfo on Linux, otherwise "unknown"
+ */
+string cpu_model()
+{
+    ifstream cpuinfo("/proc/cpuinfo");
+    string line;
+    while (getline(cpuinfo, line))
+    {
+        if (line.compare(0, 10, "model name") == 0 && line.find(':') != string::npos)
+        {
+            return line.substr(line.find(':') + 2);
+        }
+    }
+    return "unknown";
+}
+
+/**
+ * Returns where this host's profile is kept: $IMAGE_PROCESSING_PROFILE if set,
+ * otherwise <hostname>.profile in $XDG_CONFIG_HOME/image_processing, or
+ * ~/.config/image_processing
+ * @return the path
+ */
+string default_profile_path()
+{
+    const char *path = getenv("IMAGE_PROCESSING_PROFILE");
+    if (path && *path)
+    {
+        return path;
+    }
+    const char *config = getenv("XDG_CONFIG_HOME");
+    const char *home = getenv("HOME");
+    string dir = config && *config ? string(config) : string(home ? home : ".") + "/.config";
+    string host = "default";
+#ifdef __linux__
+    char name[256] = {0};
+    if (gethostname(name, sizeof(name) - 1) == 0 && name[0])
+    {
+        host = name;
+    }
+#endif
+    return dir + "/image_processing/" + host + ".profile";
+}
+
+/**
+ * Reads a profile written by save_profile()
+ * @param path    the profile's path
+ * @param profile the settings, filled in place
+ * @return false if there is no profile at path
+ */
+bool load_profile(const string &path, TuningProfile &profile)
+{
+    ifstream stream(path);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    profile = {"", 0, 0, 0};
+    string line;
+    while (getline(stream, line))
+    {
+        size_t equals = line.find('=');
+        if (line.empty() || line[0] == '#' || equals == string::npos)
+        {
+            continue;
+        }
+        string key = line.substr(0, equals);
+        string value = line.substr(equals + 1);
+        if (key == "cpu_model")
+        {
+            profile.cpu_model = value;
+        }
+        else if (key == "threads")
+        {
+            profile.threads = max(0, atoi(value.c_str()));
+        }
+        else if (key == "band_bytes")
+        {
+            profile.band_bytes = max(0, atoi(value.c_str()));
+        }
+        else if (key == "rotate_tile")
+        {
+            profile.rotate_tile = max(0, atoi(value.c_str()));
+        }
+    }
+    return true;
+}
+
+/**
+ * Creates the directories a file goes in, on Linux
+ * Helper function for save_profile() and auto_tune()
+ * @param path the file's path
+ */
+static void make_parent_dirs(const string &path)
+{
+#ifdef __linux__
+    for (size_t slash = path.find('/', 1); slash != string::npos; slash = path.find('/', slash + 1))
+    {
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+#endif
+}
+
+/**
+ * Writes a profile, creating its directory on Linux
+ * @param path    the profile's path
+ * @param profile the settings
+ * @return false if the profile could not be written
+ */
+bool save_profile(const string &path, const TuningProfile &profile)
+{
+    make_parent_dirs(path);
+    ofstream stream(path);
+    stream << "# Written by image_processing --auto-tune\n"
+           << "cpu_model=" << profile.cpu_model << "\n"
+           << "threads=" << profile.threads << "\n"
+           << "band_bytes=" << profile.band_bytes << "\n"
+           << "rotate_tile=" << profile.rotate_tile << "\n";
+    stream.close();
+    return !stream.fail();
+}
+
+/**
+ * Times a piece of work, keeping the fastest of TUNING_RUNS runs
+ * Helper function for auto_tune()
+ * @param work the work
+ * @return the fastest time in seconds
+ */
+static double best_time(const function<void()> &work)
+{
+    double best = 0;
+    for (int run = 0; run < TUNING_RUNS; ++run)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        work();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        best = run == 0 ? seconds : min(best, seconds);
+    }
+    return best;
+}
+
+/**
+ * Builds a synthetic image with gradients and fine detail, so that neither
+ * the filters nor the palette search can take shortcuts
+ * Helper function for auto_tune()
+ * @return the image
+ */
+static vector<vector<Pixel>> tuning_image()
+{
+    vector<vector<Pixel>> image(TUNING_HEIGHT, vector<Pixel>(TUNING_WIDTH));
+    unsigned int noise = 12345;
+    for (int row = 0; row < TUNING_HEIGHT; ++row)
+    {
+        for (int col = 0; col < TUNING_WIDTH; ++col)
+        {
+            noise = noise * 1103515245 + 12345;
+            int grain = (noise >> 16) % 32;
+            image[row][col] = {(col * 255 / TUNING_WIDTH + grain) % 256, (row * 255 / TUNING_HEIGHT + grain) % 256,
+                               ((row + col) % 256 + grain) % 256};
+        }
+    }
+    return image;
+}
+
+/**
+ * Measures each candidate setting on this machine and picks the fastest.
+ * The settings in use are left as they were; pass the result to set_tuning().
+ * @param scratch_filename a file the decoder and writer benchmarks may use, removed afterwards
+ * @param report           where the timings are printed
+ * @return the profile, or one with the built-in defaults if scratch_filename could not be written
+ */
+TuningProfile auto_tune(const string &scratch_filename, ostream &report)
+{
+    TuningProfile saved = tuning;
+    TuningProfile best = {cpu_model(), 0, 0, 0};
+    vector<vector<Pixel>> image = tuning_image();
+    double megapixels = TUNING_WIDTH * TUNING_HEIGHT / 1e6;
+    report << "Tuning for " << best.cpu_model << " on a " << TUNING_WIDTH << "x" << TUNING_HEIGHT << " image" << endl;
+
+    // The writer has nothing to tune, but its speed shows what the disk allows
+    make_parent_dirs(scratch_filename);
+    double write_time = best_time([&]
+                                  { write_image(scratch_filename, image); });
+    if (read_image(scratch_filename).empty())
+    {
+        report << "Could not write " << scratch_filename << ", keeping the defaults" << endl;
+        return {best.cpu_model, 0, 0, 0};
+    }
+    report << "write_image: " << megapixels / write_time << " MP/s" << endl;
+
+    // Threads, for the decoder and the banded filters together
+    double fastest = 0;
+    int hardware = max(1u, thread::hardware_concurrency());
+    vector<int> candidates;
+    for (int threads = 1; threads < hardware; threads *= 2)
+    {
+        candidates.push_back(threads);
+    }
+    candidates.push_back(hardware);
+    for (int threads : candidates)
+    {
+        tuning.threads = threads;
+        double seconds = best_time([&]
+                                   { read_image(scratch_filename); process_gaussian_blur(image, 3); });
+        report << "threads " << threads << ": " << seconds * 1000 << " ms" << endl;
+        if (best.threads == 0 || seconds < fastest)
+        {
+            best.threads = threads;
+            fastest = seconds;
+        }
+    }
+    tuning.threads = best.threads;
+    remove(scratch_filename.c_str());
+
+    // Band size of the convolution
+    for (int band_bytes = 64 * 1024; band_bytes <= 2 * 1024 * 1024; band_bytes *= 2)
+    {
+        tuning.band_bytes = band_bytes;
+        double seconds = best_time([&]
+                                   { process_gaussian_blur(image, 3); });
+        report << "band " << band_bytes / 1024 << " KB: " << seconds * 1000 << " ms" << endl;
+        if (best.band_bytes == 0 || seconds < fastest)
+        {
+            best.band_bytes = band_bytes;
+            fastest = seconds;
+        }
+    }
+    tuning.band_bytes = best.band_bytes;
+
+    // Block size of the rotation, 0 rotating row by row
+    for (int tile : {0, 8, 16, 32, 64, 128})
+    {
+        tuning.rotate_tile = tile;
+        double seconds = best_time([&]
+                                   { process_4(image); });
+        report << "rotate block " << tile << ": " << seconds * 1000 << " ms" << endl;
+        if (tile == 0 || seconds < fastest)
+        {
+            best.rotate_tile = tile;
+            fastest = seconds;
+        }
+    }
+
+    // Point filter: double or fixed point scaling. They can differ by one level,
+    // so the choice stays with --fixed-point rather than varying between hosts.
+    double double_time = best_time([&]
+                                   { process_2(image, 0.8); });
+    double fixed_time = best_time([&]
+                                  { process_2_fixed(image, 0.8); });
+    report << "clarendon: double " << double_time * 1000 << " ms, fixed point " << fixed_time * 1000 << " ms"
+           << (fixed_time < double_time ? " (--fixed-point is faster here)" : "") << endl;
+
+    tuning = saved;
+    return best;
+}
+
+} // namespace image_processing
@@ -0,0 +1,401 @@
+// Image processing library
+// The BMP codec, the filters and operation chains behind the command line
+// application, for use from other programs. Images are held as rows of
+// Pixels; the job API at the end takes pixels in the caller's own memory and
+// runs operation chains on them, either directly or on a pool of threads.
+#ifndef IMAGE_PROCESSING_H
+#define IMAGE_PROCESSING_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <ostream>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace image_processing
+{
+
+// Pixel structure
+struct Pixel
+{
+    // Red, green, blue color values
+    int red;
+    int green;
+    int blue;
+};
+
+// Image stored as palette indices, for images with at most 256 colors
+struct IndexedImage
+{
+    std::vector<Pixel> palette;
+    std::vector<std::vector<unsigned char>> indices;
+};
+
+// BMP header fields needed to locate the pixel array
+struct BmpInfo
+{
+    int file_size;
+    int start;
+    int width;
+    int height;
+    int bits_per_pixel;
+    int compression; // 0 = BI_RGB, 1 = BI_RLE8, 2 = BI_RLE4
+    int colors;      // Palette entries, for 1, 4 and 8 bits per pixel
+    int row_bytes;   // Bytes per scan line, including padding
+};
+
+// Channels of the image statistics
+enum StatsChannel
+{
+    STATS_RED,
+    STATS_GREEN,
+    STATS_BLUE,
+    STATS_LUMINANCE, // (red + green + blue) / 3, the gray value the filters use
+    STATS_CHANNELS
+};
+
+// Image statistics, gathered while an image is decoded
+struct ImageStats
+{
+    long long histogram[STATS_CHANNELS][256];
+    int min[STATS_CHANNELS];
+    int max[STATS_CHANNELS];
+    double mean[STATS_CHANNELS];
+    long long pixel_count;
+};
+
+// Rectangle of an image in pixels, measured from the top left corner
+struct Region
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Output pixel formats for write_image()
+enum BmpFormat
+{
+    BMP_RGB24,      // 24 bits per pixel
+    BMP_INDEXED,    // 1, 4 or 8 bits per pixel with a palette, if the image has at most 256 colors
+    BMP_INDEXED_RLE // As BMP_INDEXED, run-length encoded (BI_RLE4 or BI_RLE8) when that is smaller
+};
+
+// A filter from one image to another, as applied by the menu
+typedef std::function<std::vector<std::vector<Pixel>>(const std::vector<std::vector<Pixel>> &)> Filter;
+
+// Fixed-point scale of convolution weights
+const int KERNEL_SHIFT = 16;
+const int KERNEL_ONE = 1 << KERNEL_SHIFT;
+
+// One pass of a separable convolution
+struct ConvolutionPass
+{
+    int radius;               // Pixels either side of the center
+    std::vector<int> weights; // 2 * radius + 1 weights summing to KERNEL_ONE, or empty for a box
+};
+
+// Filters for process_resize()
+enum ResampleFilter
+{
+    RESAMPLE_BOX,      // Area average when shrinking, nearest neighbor when enlarging
+    RESAMPLE_BILINEAR, // Triangle filter
+    RESAMPLE_LANCZOS   // Windowed sinc with three lobes
+};
+
+// One step of an operation chain
+struct Operation
+{
+    int process;                // The menu number of the process
+    std::vector<double> params; // Its parameters, in the order the menu asks for them
+};
+
+/**
+ * Adds a pixel to the histograms of the image statistics
+ * Helper function for the image readers
+ * @param stats the statistics to update
+ * @param p     the decoded pixel
+ */
+inline void add_to_stats(ImageStats &stats, const Pixel &p)
+{
+    stats.histogram[STATS_RED][p.red]++;
+    stats.histogram[STATS_GREEN][p.green]++;
+    stats.histogram[STATS_BLUE][p.blue]++;
+    stats.histogram[STATS_LUMINANCE][(p.red + p.green + p.blue) / 3]++;
+}
+
+// Statistics and threads
+void finish_stats(ImageStats &stats);
+int thread_count();
+int set_thread_limit(int threads);
+
+// Reading BMP images
+bool parse_bmp_info(const unsigned char header[], BmpInfo &info);
+bool read_bmp_info(std::fstream &stream, BmpInfo &info);
+bool read_indexed_image(std::string filename, IndexedImage &indexed);
+std::vector<std::vector<Pixel>> expand_indexed(const IndexedImage &indexed, ImageStats *stats = nullptr);
+void indexed_stats(const IndexedImage &indexed, ImageStats &stats);
+std::vector<std::vector<Pixel>> read_image(std::string filename, ImageStats *stats = nullptr);
+std::vector<std::vector<Pixel>> read_image_stream(FILE *file, ImageStats *stats = nullptr);
+std::vector<std::vector<Pixel>> read_image_preview(std::string filename, int step, ImageStats *stats = nullptr);
+bool clip_region(Region &region, int width, int height);
+std::vector<std::vector<Pixel>> read_image_region(std::string filename, Region &region, ImageStats *stats = nullptr);
+
+// Writing BMP images
+bool find_palette(const std::vector<std::vector<Pixel>> &image, IndexedImage &indexed);
+std::vector<unsigned char> encode_indexed_image(const IndexedImage &indexed, bool compress = false);
+bool write_indexed_image(std::string filename, const IndexedImage &indexed, bool compress = false);
+bool write_image(std::string filename, const std::vector<std::vector<Pixel>> &image, BmpFormat format = BMP_RGB24);
+bool write_image_stream(FILE *file, const std::vector<std::vector<Pixel>> &image, BmpFormat format = BMP_RGB24);
+bool copy_image_stream(std::string filename, FILE *file);
+bool write_image_region(std::string input_filename, std::string output_filename, const Region &region,
+                        const std::vector<std::vector<Pixel>> &image);
+
+// Filters, numbered as in the menu
+std::vector<std::vector<Pixel>> process_1(const std::vector<std::vector<Pixel>> &image);
+std::vector<std::vector<Pixel>> process_2(const std::vector<std::vector<Pixel>> &image, double scaling_factor);
+std::vector<std::vector<Pixel>> process_3(const std::vector<std::vector<Pixel>> &image);
+std::vector<std::vector<Pixel>> process_4(const std::vector<std::vector<Pixel>> &image);
+std::vector<std::vector<Pixel>> process_5(const std::vector<std::vector<Pixel>> &image, int number);
+std::vector<std::vector<Pixel>> process_6(const std::vector<std::vector<Pixel>> &image, int x_scale, int y_scale);
+std::vector<std::vector<Pixel>> process_7(const std::vector<std::vector<Pixel>> &image, int threshold = 255 / 2);
+std::vector<std::vector<Pixel>> process_8(const std::vector<std::vector<Pixel>> &image, double scaling_factor);
+std::vector<std::vector<Pixel>> process_9(const std::vector<std::vector<Pixel>> &image, double scaling_factor);
+std::vector<std::vector<Pixel>> process_10(const std::vector<std::vector<Pixel>> &image);
+IndexedImage process_7_indexed(const std::vector<std::vector<Pixel>> &image, int threshold = 255 / 2);
+IndexedImage process_10_indexed(const std::vector<std::vector<Pixel>> &image);
+
+// Filters that take their settings from the image statistics
+int stats_percentile(const ImageStats &stats, int channel, double fraction);
+int auto_threshold(const ImageStats &stats);
+double auto_clarendon_factor(const ImageStats &stats);
+std::vector<std::vector<Pixel>> process_2_auto(const std::vector<std::vector<Pixel>> &image, const ImageStats &stats);
+std::vector<std::vector<Pixel>> process_7_auto(const std::vector<std::vector<Pixel>> &image, const ImageStats &stats);
+std::vector<std::vector<Pixel>> process_auto_levels(const std::vector<std::vector<Pixel>> &image, const ImageStats &stats);
+
+// Convolution and resampling
+std::vector<std::vector<Pixel>> convolve(const std::vector<std::vector<Pixel>> &image, const std::vector<ConvolutionPass> &passes);
+std::vector<ConvolutionPass> gaussian_passes(double sigma);
+std::vector<std::vector<Pixel>> process_box_blur(const std::vector<std::vector<Pixel>> &image, int radius);
+std::vector<std::vector<Pixel>> process_gaussian_blur(const std::vector<std::vector<Pixel>> &image, double sigma);
+std::vector<std::vector<Pixel>> process_unsharp_mask(const std::vector<std::vector<Pixel>> &image, double sigma, double amount);
+std::vector<std::vector<Pixel>> process_resize(const std::vector<std::vector<Pixel>> &image, int new_width, int new_height,
+                                               ResampleFilter filter = RESAMPLE_LANCZOS);
+
+// Fixed-point versions of the scaling filters
+std::vector<std::vector<Pixel>> process_1_fixed(const std::vector<std::vector<Pixel>> &image);
+std::vector<std::vector<Pixel>> process_2_fixed(const std::vector<std::vector<Pixel>> &image, double scaling_factor);
+std::vector<std::vector<Pixel>> process_8_fixed(const std::vector<std::vector<Pixel>> &image, double scaling_factor);
+std::vector<std::vector<Pixel>> process_9_fixed(const std::vector<std::vector<Pixel>> &image, double scaling_factor);
+bool verify_fixed_point();
+
+// Operation chains
+bool operation_valid(const Operation &operation);
+bool parse_operations(const std::string &spec, std::vector<Operation> &operations);
+bool operation_color_only(const Operation &operation);
+Filter operation_filter(const Operation &operation, const ImageStats &stats, bool fixed_point = false);
+std::vector<std::vector<Pixel>> apply_operations(std::vector<std::vector<Pixel>> image, const std::vector<Operation> &operations,
+                                                 const ImageStats &stats, bool fixed_point = false);
+bool apply_operations_indexed(IndexedImage &indexed, const std::vector<Operation> &operations, bool fixed_point = false);
+void operation_size(const Operation &operation, int &width, int &height);
+
+// Tile pyramid
+
+// Settings for write_pyramid()
+struct PyramidConfig
+{
+    std::string directory;             // Where the level directories go
+    int tile_size;                     // Width and height of the tiles, an even number
+    std::vector<Operation> operations; // Color filters to apply on the way
+    bool fixed_point;
+    BmpFormat format;                  // Format of the tiles
+};
+
+bool operation_pyramid(const Operation &operation);
+bool write_pyramid(FILE *file, const PyramidConfig &config, int &levels);
+
+// Memory budget
+long long estimate_peak_bytes(const BmpInfo &info, const std::vector<Operation> &operations, BmpFormat format = BMP_RGB24);
+bool operations_streamable(const std::vector<Operation> &operations);
+long long estimate_streaming_bytes(const BmpInfo &info);
+bool apply_operations_streaming(std::string input_filename, std::string output_filename, const std::vector<Operation> &operations,
+                                bool fixed_point = false);
+
+// Memory shared by jobs running at the same time. Each job reserves its
+// estimated peak before it starts and hands it back when it ends.
+class MemoryBudget
+{
+public:
+    explicit MemoryBudget(long long bytes);
+    long long acquire(long long bytes);
+    void release(long long bytes);
+    long long limit() const;
+
+private:
+    long long total;
+    long long used;
+    long long next_ticket; // Handed to each caller of acquire() in turn
+    long long serving;     // The ticket admitted next
+    std::mutex guard;
+    std::condition_variable released;
+};
+
+// Auto-tuning
+
+// Settings measured to be fastest on a machine. Zeros leave the built-in defaults.
+struct TuningProfile
+{
+    std::string cpu_model; // The CPU the settings were measured on
+    int threads;           // Threads for decoding and the banded filters
+    int band_bytes;        // Working set of one convolution band
+    int rotate_tile;       // Block size of the rotation, or 0 to rotate row by row
+};
+
+const TuningProfile &current_tuning();
+void set_tuning(const TuningProfile &profile);
+std::string cpu_model();
+std::string default_profile_path();
+bool load_profile(const std::string &path, TuningProfile &profile);
+bool save_profile(const std::string &path, const TuningProfile &profile);
+TuningProfile auto_tune(const std::string &scratch_filename, std::ostream &report);
+
+// Queue with a fixed capacity, shared between threads. push() blocks while the
+// queue is full, which holds back whoever is producing work until it drains.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(std::max((size_t)1, capacity)), closed(false) {}
+
+    /**
+     * Adds an item, waiting for space
+     * @return false if the queue was closed
+     */
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(guard);
+        not_full.wait(lock, [this]
+                      { return items.size() < capacity || closed; });
+        if (closed)
+        {
+            return false;
+        }
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    /**
+     * Removes the oldest item, waiting for one to arrive
+     * @return false once the queue is closed and empty
+     */
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(guard);
+        not_empty.wait(lock, [this]
+                       { return !items.empty() || closed; });
+        if (items.empty())
+        {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    // Stops further pushes; pop() drains what is left and then returns false
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(guard);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex guard;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+// Job API
+
+// Channel order and size of the pixels in a caller's buffer
+enum PixelLayout
+{
+    LAYOUT_RGB24,
+    LAYOUT_BGR24,
+    LAYOUT_RGBA32, // Alpha is ignored on input and written as 255
+    LAYOUT_BGRA32
+};
+
+// Pixels in memory the caller owns, top row first. Rows are stride bytes
+// apart, so a buffer can have padded rows or be a window into a larger image.
+struct PixelBuffer
+{
+    unsigned char *data;
+    int width;
+    int height;
+    std::ptrdiff_t stride; // Bytes from the start of one row to the start of the next
+    PixelLayout layout;
+};
+
+// Set to true to cancel the jobs that share it
+typedef std::shared_ptr<std::atomic<bool>> CancelFlag;
+
+// An operation chain to run from one buffer to another
+struct Job
+{
+    PixelBuffer input;
+    PixelBuffer output; // Must have the size chain_output_size() gives for the input
+    std::vector<Operation> operations;
+    bool fixed_point;   // Use the fixed-point scaling filters
+    CancelFlag cancel;  // May be null. Checked before each step; a cancelled job leaves output untouched
+};
+
+// Outcome of a job
+enum JobStatus
+{
+    JOB_DONE,
+    JOB_CANCELLED,
+    JOB_FAILED // The chain is invalid or the output buffer has the wrong size
+};
+
+void chain_output_size(const std::vector<Operation> &operations, int &width, int &height);
+JobStatus run_job(const Job &job);
+
+// Runs jobs on a pool of threads, each job on one worker with its filters
+// single-threaded. submit() waits while queue_size jobs are already waiting;
+// the destructor finishes every job submitted.
+class Processor
+{
+public:
+    explicit Processor(int threads = 0, size_t queue_size = 64); // 0 threads means one per core
+    ~Processor();
+    std::future<JobStatus> submit(const Job &job);
+
+private:
+    Processor(const Processor &);
+    Processor &operator=(const Processor &);
+
+    BoundedQueue<std::shared_ptr<std::packaged_task<JobStatus()>>> queue;
+    std::vector<std::thread> workers;
+};
+
+} // namespace image_processing
+
+#endif
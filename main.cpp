@@ -7,209 +7,32 @@
 #include <algorithm>
 #include <limits>
 #include <sstream>
+#include <functional>
+#include <cstdlib>
+#include <thread>
+#include <memory>
+#include <set>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cerrno>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+#include "image_processing.h"
 using namespace std;
-
-// Pixel structure
-struct Pixel
-{
-    // Red, green, blue color values
-    int red;
-    int green;
-    int blue;
-};
-
-/**
- * Gets an integer from a binary stream.
- * Helper function for read_image()
- * @param stream the stream
- * @param offset the offset at which to read the integer
- * @param bytes  the number of bytes to read
- * @return the integer starting at the given offset
- */
-int get_int(fstream &stream, int offset, int bytes)
-{
-    stream.seekg(offset);
-    int result = 0;
-    int base = 1;
-    for (int i = 0; i < bytes; i++)
-    {
-        result = result + stream.get() * base;
-        base = base * 256;
-    }
-    return result;
-}
-
-/**
- * Reads the BMP image specified and returns the resulting image as a vector
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
- */
-vector<vector<Pixel>> read_image(string filename)
-{
-    // Open the binary file
-    fstream stream;
-    stream.open(filename, ios::in | ios::binary);
-
-    // Get the image properties
-    int file_size = get_int(stream, 2, 4);
-    int start = get_int(stream, 10, 4);
-    int width = get_int(stream, 18, 4);
-    int height = get_int(stream, 22, 4);
-    int bits_per_pixel = get_int(stream, 28, 2);
-
-    // Scan lines must occupy multiples of four bytes
-    int scanline_size = width * (bits_per_pixel / 8);
-    int padding = 0;
-    if (scanline_size % 4 != 0)
-    {
-        padding = 4 - scanline_size % 4;
-    }
-
-    // Return empty vector if this is not a valid image
-    if (file_size != start + (scanline_size + padding) * height)
-    {
-        return {};
-    }
-
-    // Create a vector the size of the input image
-    vector<vector<Pixel>> image(height, vector<Pixel>(width));
-
-    int pos = start;
-    // For each row, starting from the last row to the first
-    // Note: BMP files store pixels from bottom to top
-    for (int i = height - 1; i >= 0; i--)
-    {
-        // For each column
-        for (int j = 0; j < width; j++)
-        {
-            // Go to the pixel position
-            stream.seekg(pos);
-
-            // Save the pixel values to the image vector
-            // Note: BMP files store pixels in blue, green, red order
-            image[i][j].blue = stream.get();
-            image[i][j].green = stream.get();
-            image[i][j].red = stream.get();
-
-            // We are ignoring the alpha channel if there is one
-
-            // Advance the position to the next pixel
-            pos = pos + (bits_per_pixel / 8);
-        }
-
-        // Skip the padding at the end of each row
-        stream.seekg(padding, ios::cur);
-        pos = pos + padding;
-    }
-
-    // Close the stream and return the image vector
-    stream.close();
-    return image;
-}
-
-/**
- * Sets a value to the char array starting at the offset using the size
- * specified by the bytes.
- * This is a helper function for write_image()
- * @param arr    Array to set values for
- * @param offset Starting index offset
- * @param bytes  Number of bytes to set
- * @param value  Value to set
- * @return nothing
- */
-void set_bytes(unsigned char arr[], int offset, int bytes, int value)
-{
-    for (int i = 0; i < bytes; i++)
-    {
-        arr[offset + i] = (unsigned char)(value >> (i * 8));
-    }
-}
-
-/**
- * Write the input image to a BMP file name specified
- * @param filename The BMP file name to save the image to
- * @param image    The input image to save
- * @return True if successful and false otherwise
- */
-bool write_image(string filename, const vector<vector<Pixel>> &image)
-{
-    // Get the image width and height in pixels
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
-
-    // Calculate the width in bytes incorporating padding (4 byte alignment)
-    int width_bytes = width_pixels * 3;
-    int padding_bytes = 0;
-    padding_bytes = (4 - width_bytes % 4) % 4;
-    width_bytes = width_bytes + padding_bytes;
-
-    // Pixel array size in bytes, including padding
-    int array_bytes = width_bytes * height_pixels;
-
-    // Open a file stream for writing to a binary file
-    fstream stream;
-    stream.open(filename, ios::out | ios::binary);
-
-    // If there was a problem opening the file, return false
-    if (!stream.is_open())
-    {
-        return false;
-    }
-
-    // Create the BMP and DIB Headers
-    const int BMP_HEADER_SIZE = 14;
-    const int DIB_HEADER_SIZE = 40;
-    unsigned char bmp_header[BMP_HEADER_SIZE] = {0};
-    unsigned char dib_header[DIB_HEADER_SIZE] = {0};
-
-    // BMP Header
-    set_bytes(bmp_header, 0, 1, 'B');                                             // ID field
-    set_bytes(bmp_header, 1, 1, 'M');                                             // ID field
-    set_bytes(bmp_header, 2, 4, BMP_HEADER_SIZE + DIB_HEADER_SIZE + array_bytes); // Size of BMP file
-    set_bytes(bmp_header, 6, 2, 0);                                               // Reserved
-    set_bytes(bmp_header, 8, 2, 0);                                               // Reserved
-    set_bytes(bmp_header, 10, 4, BMP_HEADER_SIZE + DIB_HEADER_SIZE);              // Pixel array offset
-
-    // DIB Header
-    set_bytes(dib_header, 0, 4, DIB_HEADER_SIZE); // DIB header size
-    set_bytes(dib_header, 4, 4, width_pixels);    // Width of bitmap in pixels
-    set_bytes(dib_header, 8, 4, height_pixels);   // Height of bitmap in pixels
-    set_bytes(dib_header, 12, 2, 1);              // Number of color planes
-    set_bytes(dib_header, 14, 2, 24);             // Number of bits per pixel
-    set_bytes(dib_header, 16, 4, 0);              // Compression method (0=BI_RGB)
-    set_bytes(dib_header, 20, 4, array_bytes);    // Size of raw bitmap data (including padding)
-    set_bytes(dib_header, 24, 4, 2835);           // Print resolution of image (2835 pixels/meter)
-    set_bytes(dib_header, 28, 4, 2835);           // Print resolution of image (2835 pixels/meter)
-    set_bytes(dib_header, 32, 4, 0);              // Number of colors in palette
-    set_bytes(dib_header, 36, 4, 0);              // Number of important colors
-
-    // Write the BMP and DIB Headers to the file
-    stream.write((char *)bmp_header, sizeof(bmp_header));
-    stream.write((char *)dib_header, sizeof(dib_header));
-
-    // Initialize pixel and padding
-    unsigned char pixel[3] = {0};
-    unsigned char padding[3] = {0};
-
-    // Pixel Array (Left to right, bottom to top, with padding)
-    for (int h = height_pixels - 1; h >= 0; h--)
-    {
-        for (int w = 0; w < width_pixels; w++)
-        {
-            // Write the pixel (Blue, Green, Red)
-            pixel[0] = image[h][w].blue;
-            pixel[1] = image[h][w].green;
-            pixel[2] = image[h][w].red;
-            stream.write((char *)pixel, 3);
-        }
-        // Write the padding bytes
-        stream.write((char *)padding, padding_bytes);
-    }
-
-    // Close the stream and return true
-    stream.close();
-    return true;
-}
+using namespace image_processing;
 
 // Input filename check
 // bool set to false - when false user has the option to quit.
@@ -306,6 +129,29 @@ string getValidBMPFilenameOutput()
     }
 }
 
+// Number check
+// Asks again until the input is a number
+double getValidNumber(const string &prompt)
+{
+    double value;
+    while (true)
+    {
+        cout << prompt;
+        cin >> value;
+
+        if (cin.fail())
+        {
+            cin.clear();                                         // clear error state
+            cin.ignore(numeric_limits<streamsize>::max(), '\n'); // Ignore invalid input
+            cout << "Invalid input. Please enter a number." << endl;
+        }
+        else
+        {
+            return value;
+        }
+    }
+}
+
 // check for cancellation
 bool cancellationCheck(const string &filename)
 {
@@ -316,342 +162,1982 @@ bool cancellationCheck(const string &filename)
     return false; // cancellation has not been selected by the user
 }
 
-// Process 1 - vignette effect
-vector<vector<Pixel>> process_1(const vector<vector<Pixel>> &image)
+/**
+ * Inserts ".preview" ahead of the .bmp extension of an output filename
+ * @param filename the output filename
+ * @return the filename for the preview of that output
+ */
+string previewFilename(const string &filename)
 {
-    // Get the number of rows/columns from the input 2D vector (remember: num_rows is height, num_columns is width)
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-
-    // Calculating the center of the image
-    double center_row = num_rows / 2;
-    double center_col = num_columns / 2;
+    return filename.substr(0, filename.size() - 4) + ".preview.bmp";
+}
 
-    // Define a new 2D vector the same size as the input 2D vector
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
-    // For each of the rows in the input 2D vector
-    for (int row = 0; row < num_rows; ++row)
-    {
-        for (int col = 0; col < num_columns; ++col)
-        {
-            // Distance to the center
-            double distance = sqrt(pow(col - center_col, 2) + pow(row - center_row, 2));
-            double scaling_factor = (num_rows - distance) / num_rows;
+// Undo history
+// Each history entry is stored as square tiles. A tile that comes out of a
+// filter unchanged is shared with the entry before it rather than copied, so
+// geometric no-ops and partial edits cost only the tiles that changed. Tiles
+// that only older entries still use are packed to bytes and run-length
+// encoded.
+const int TILE_SIZE = 64;
+const int HISTORY_RAW_ENTRIES = 2; // Entries nearest the current one that keep raw tiles
+
+// Block of up to TILE_SIZE x TILE_SIZE pixels, row by row
+struct Tile
+{
+    vector<Pixel> pixels;       // Raw pixels, empty once the tile is compressed
+    vector<unsigned char> runs; // Compressed pixels: run length, blue, green, red
+};
 
-            // Scale new color values
-            int new_red = static_cast<int>(image[row][col].red * scaling_factor);
-            int new_green = static_cast<int>(image[row][col].green * scaling_factor);
-            int new_blue = static_cast<int>(image[row][col].blue * scaling_factor);
+// Image stored as rows of tiles from the top left
+struct TiledImage
+{
+    int width;
+    int height;
+    vector<shared_ptr<Tile>> tiles;
+};
 
-            // Set new pixel values
-            new_image[row][col].red = new_red;
-            new_image[row][col].green = new_green;
-            new_image[row][col].blue = new_blue;
-        }
+/**
+ * Gets the pixels of a tile, expanding them if the tile is compressed
+ * @param tile   the tile
+ * @param pixels the tile's pixels, row by row
+ */
+void tile_pixels(const Tile &tile, vector<Pixel> &pixels)
+{
+    if (tile.runs.empty())
+    {
+        pixels = tile.pixels;
+        return;
     }
 
-    return new_image;
+    pixels.clear();
+    for (size_t i = 0; i < tile.runs.size(); i += 4)
+    {
+        Pixel p = {tile.runs[i + 3], tile.runs[i + 2], tile.runs[i + 1]};
+        pixels.insert(pixels.end(), tile.runs[i], p);
+    }
 }
 
-// Process 2 - clarendon effect
-vector<vector<Pixel>> process_2(const vector<vector<Pixel>> &image, double scaling_factor)
+/**
+ * Run-length encodes a tile's pixels as bytes. Tiles holding values outside
+ * 0-255 (which some filters produce) are left raw so no value is lost.
+ * @param tile the tile, compressed in place
+ */
+void compress_tile(Tile &tile)
 {
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
-
-    for (int row = 0; row < num_rows; ++row)
+    if (tile.pixels.empty())
     {
-        for (int col = 0; col < num_columns; ++col)
+        return;
+    }
+    for (const Pixel &p : tile.pixels)
+    {
+        if (p.red < 0 || p.red > 255 || p.green < 0 || p.green > 255 || p.blue < 0 || p.blue > 255)
         {
-            const Pixel &p = image[row][col];
-            int red_value = p.red;
-            int green_value = p.green;
-            int blue_value = p.blue;
+            return;
+        }
+    }
 
-            // Average the values
-            int average_value = (red_value + green_value + blue_value) / 3;
+    vector<unsigned char> runs;
+    for (size_t i = 0; i < tile.pixels.size();)
+    {
+        const Pixel &p = tile.pixels[i];
+        size_t length = 1;
+        while (length < 255 && i + length < tile.pixels.size() && tile.pixels[i + length].red == p.red &&
+               tile.pixels[i + length].green == p.green && tile.pixels[i + length].blue == p.blue)
+        {
+            length++;
+        }
+        unsigned char run[4] = {(unsigned char)length, (unsigned char)p.blue, (unsigned char)p.green, (unsigned char)p.red};
+        runs.insert(runs.end(), run, run + 4);
+        i += length;
+    }
 
-            int new_red, new_green, new_blue;
+    tile.runs.swap(runs);
+    vector<Pixel>().swap(tile.pixels);
+}
 
-            // Adjusting pixel brightness according to average_value
-            if (average_value >= 170)
+/**
+ * Splits an image into tiles, sharing every tile that is unchanged from the
+ * same position of the previous image
+ * @param image    the image
+ * @param previous the previous image, or nullptr
+ * @return the tiled image
+ */
+TiledImage make_tiled(const vector<vector<Pixel>> &image, const TiledImage *previous)
+{
+    TiledImage tiled;
+    tiled.height = image.size();
+    tiled.width = image.empty() ? 0 : image[0].size();
+    bool same_size = previous && previous->width == tiled.width && previous->height == tiled.height;
+
+    vector<Pixel> pixels;
+    vector<Pixel> previous_pixels;
+    for (int tile_row = 0; tile_row < tiled.height; tile_row += TILE_SIZE)
+    {
+        for (int tile_col = 0; tile_col < tiled.width; tile_col += TILE_SIZE)
+        {
+            pixels.clear();
+            for (int row = tile_row; row < min(tiled.height, tile_row + TILE_SIZE); ++row)
             {
-                new_red = static_cast<int>(255 - (255 - red_value) * scaling_factor);
-                new_green = static_cast<int>(255 - (255 - green_value) * scaling_factor);
-                new_blue = static_cast<int>(255 - (255 - blue_value) * scaling_factor);
+                pixels.insert(pixels.end(), image[row].begin() + tile_col,
+                              image[row].begin() + min(tiled.width, tile_col + TILE_SIZE));
             }
-            else if (average_value < 90)
+
+            if (same_size)
             {
-                new_red = static_cast<int>(red_value * scaling_factor);
-                new_green = static_cast<int>(green_value * scaling_factor);
-                new_blue = static_cast<int>(blue_value * scaling_factor);
+                const shared_ptr<Tile> &shared = previous->tiles[tiled.tiles.size()];
+                tile_pixels(*shared, previous_pixels);
+                if (equal(pixels.begin(), pixels.end(), previous_pixels.begin(), [](const Pixel &a, const Pixel &b)
+                          { return a.red == b.red && a.green == b.green && a.blue == b.blue; }))
+                {
+                    tiled.tiles.push_back(shared);
+                    continue;
+                }
             }
-            else
+
+            shared_ptr<Tile> tile = make_shared<Tile>();
+            tile->pixels = pixels;
+            tiled.tiles.push_back(tile);
+        }
+    }
+    return tiled;
+}
+
+/**
+ * Reassembles a tiled image
+ * @param tiled the tiled image
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> untile(const TiledImage &tiled)
+{
+    vector<vector<Pixel>> image(tiled.height, vector<Pixel>(tiled.width));
+    vector<Pixel> pixels;
+    size_t index = 0;
+    for (int tile_row = 0; tile_row < tiled.height; tile_row += TILE_SIZE)
+    {
+        for (int tile_col = 0; tile_col < tiled.width; tile_col += TILE_SIZE)
+        {
+            tile_pixels(*tiled.tiles[index++], pixels);
+            int tile_width = min(tiled.width, tile_col + TILE_SIZE) - tile_col;
+            auto next = pixels.begin();
+            for (int row = tile_row; row < min(tiled.height, tile_row + TILE_SIZE); ++row)
             {
-                new_red = red_value;
-                new_green = green_value;
-                new_blue = blue_value;
+                copy(next, next + tile_width, image[row].begin() + tile_col);
+                next += tile_width;
             }
-
-            new_image[row][col].red = new_red;
-            new_image[row][col].green = new_green;
-            new_image[row][col].blue = new_blue;
         }
     }
-    return new_image;
+    return image;
 }
 
-// Process 3 - grayscale image
-vector<vector<Pixel>> process_3(const vector<vector<Pixel>> &image)
+// Undo/redo history of the interactive session
+struct History
 {
-    int num_rows = image.size();
-    int num_columns = image[0].size();
+    vector<TiledImage> entries; // Entry 0 is the loaded image
+    vector<Filter> steps;       // steps[i] turns entry i into entry i + 1
+    size_t position;            // Index of the current entry
+};
 
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+/**
+ * Starts a new history from a freshly loaded image
+ * @param history the history to reset
+ * @param image   the loaded image
+ */
+void history_reset(History &history, const vector<vector<Pixel>> &image)
+{
+    history.entries.assign(1, make_tiled(image, nullptr));
+    history.steps.clear();
+    history.position = 0;
+}
 
-    for (int row = 0; row < num_rows; ++row)
+/**
+ * Records a filtered image as the new current entry, dropping anything that
+ * could have been redone, and compresses tiles only older entries still use
+ * @param history the history
+ * @param image   the filtered image
+ * @param filter  the filter that produced it from the current entry
+ */
+void history_push(History &history, const vector<vector<Pixel>> &image, const Filter &filter)
+{
+    history.entries.resize(history.position + 1);
+    history.steps.resize(history.position);
+
+    history.entries.push_back(make_tiled(image, &history.entries.back()));
+    history.steps.push_back(filter);
+    history.position++;
+
+    // Tiles of the newest entries stay raw for a fast undo
+    set<const Tile *> recent;
+    for (size_t i = history.entries.size() - min(history.entries.size(), (size_t)HISTORY_RAW_ENTRIES); i < history.entries.size(); ++i)
     {
-        for (int col = 0; col < num_columns; ++col)
+        for (const auto &tile : history.entries[i].tiles)
         {
-            const Pixel &p = image[row][col];
-            int red_value = p.red;
-            int green_value = p.green;
-            int blue_value = p.blue;
+            recent.insert(tile.get());
+        }
+    }
+    for (size_t i = 0; i + HISTORY_RAW_ENTRIES < history.entries.size(); ++i)
+    {
+        for (const auto &tile : history.entries[i].tiles)
+        {
+            if (!recent.count(tile.get()))
+            {
+                compress_tile(*tile);
+            }
+        }
+    }
+}
 
-            // Calculate Gray Value
-            int gray_value = (red_value + green_value + blue_value) / 3;
+/**
+ * Steps the history back one entry
+ * @param history the history
+ * @param image   set to the image of the new current entry
+ * @return false if there is nothing to undo
+ */
+bool history_undo(History &history, vector<vector<Pixel>> &image)
+{
+    if (history.position == 0)
+    {
+        return false;
+    }
+    history.position--;
+    image = untile(history.entries[history.position]);
+    return true;
+}
 
-            // Set pixels to gray value
+/**
+ * Steps the history forward one entry
+ * @param history the history
+ * @param image   set to the image of the new current entry
+ * @return false if there is nothing to redo
+ */
+bool history_redo(History &history, vector<vector<Pixel>> &image)
+{
+    if (history.position + 1 >= history.entries.size())
+    {
+        return false;
+    }
+    history.position++;
+    image = untile(history.entries[history.position]);
+    return true;
+}
 
-            int new_red = gray_value;
-            int new_green = gray_value;
-            int new_blue = gray_value;
+/**
+ * Applies the filters that led to the current entry to another image, such
+ * as the full resolution version of a preview
+ * @param history the history
+ * @param image   the image to filter
+ * @return the image after every step up to the current entry
+ */
+vector<vector<Pixel>> history_replay(const History &history, vector<vector<Pixel>> image)
+{
+    for (size_t i = 0; i < history.position; ++i)
+    {
+        image = history.steps[i](image);
+    }
+    return image;
+}
 
-            new_image[row][col].red = new_red;
-            new_image[row][col].green = new_green;
-            new_image[row][col].blue = new_blue;
+/**
+ * Totals the memory held by the distinct tiles of every history entry
+ * @param history the history
+ * @return the number of bytes of pixel data
+ */
+size_t history_bytes(const History &history)
+{
+    set<const Tile *> counted;
+    size_t bytes = 0;
+    for (const auto &entry : history.entries)
+    {
+        for (const auto &tile : entry.tiles)
+        {
+            if (counted.insert(tile.get()).second)
+            {
+                bytes += tile->pixels.size() * sizeof(Pixel) + tile->runs.size();
+            }
         }
     }
-
-    return new_image;
+    return bytes;
 }
 
-// Process 4 - rotates image by 90 degrees clockwise (not counter-clockwise)
-vector<vector<Pixel>> process_4(const vector<vector<Pixel>> &image)
+// How the interactive session loads its input and writes each output
+struct RenderOptions
 {
-    int num_rows = image.size();
-    int num_columns = image[0].size();
+    int preview_step; // Preview decimation step, 1 when preview mode is off
+    bool use_region;  // Load and filter only the region of interest
+    Region region;    // The region of interest as requested
+    bool write_back;  // Write the filtered region into a copy of the full image
+    Region loaded;    // The region of interest clipped to the loaded image
+    BmpFormat format; // Pixel format of the outputs
+};
 
-    vector<vector<Pixel>> new_image(num_columns, vector<Pixel>(num_rows));
+// A filter that emits palette indices instead of pixels
+typedef function<IndexedImage(const vector<vector<Pixel>> &)> IndexedFilter;
 
-    for (int row = 0; row < num_rows; ++row)
+// State of the interactive session
+struct Session
+{
+    string filename;             // The loaded BMP filename
+    vector<vector<Pixel>> image; // The working image, expanded on first use for palettized inputs
+    ImageStats stats;            // Gathered while the image was decoded
+    RenderOptions options;
+    bool use_history;            // Whether filters chain onto the working image
+    History history;
+    bool indexed;                // Whether the input is palettized
+    IndexedImage indexed_image;  // The palettized input
+};
+
+/**
+ * Loads the input image as the render options ask: the whole image, its
+ * decimated preview, or only the region of interest. Palettized inputs are
+ * kept as palette and indices, and only expanded to pixels when a filter
+ * needs them. The session is left unchanged if the image fails to load.
+ * @param session  the session
+ * @param filename the BMP image filename
+ * @return true if the image loaded
+ */
+bool loadImage(Session &session, const string &filename)
+{
+    RenderOptions &options = session.options;
+    vector<vector<Pixel>> image;
+    IndexedImage indexed_image;
+    ImageStats stats;
+    Region loaded = options.region;
+    bool indexed = false;
+
+    if (options.use_region)
     {
-        for (int col = 0; col < num_columns; ++col)
-        {
-            const Pixel &p = image[row][col];
+        image = read_image_region(filename, loaded, &stats);
+    }
+    else if (options.preview_step > 1)
+    {
+        image = read_image_preview(filename, options.preview_step, &stats);
+    }
+    else if (read_indexed_image(filename, indexed_image))
+    {
+        indexed = true;
+        indexed_stats(indexed_image, stats);
+    }
+    else
+    {
+        image = read_image(filename, &stats);
+    }
+
+    if (image.empty() && !indexed)
+    {
+        return false;
+    }
 
-            // 90 degree rotation logic
-            new_image[col][num_rows - 1 - row] = p;
+    session.filename = filename;
+    session.image.swap(image);
+    session.indexed_image = indexed_image;
+    session.indexed = indexed;
+    session.stats = stats;
+    options.loaded = loaded;
+
+    // History entries need pixels from the start
+    if (session.use_history)
+    {
+        if (indexed)
+        {
+            session.image = expand_indexed(indexed_image);
         }
+        history_reset(session.history, session.image);
     }
+    return true;
+}
 
-    return new_image;
+/**
+ * Writes a filtered image loaded by loadImage()
+ * Helper function for renderOutput()
+ * @param outputFilename the output BMP filename
+ * @param inputFilename  the loaded BMP filename
+ * @param options        the render options
+ * @param image          the filtered image
+ * @return true if the output was written
+ */
+bool writeOutput(const string &outputFilename, const string &inputFilename, const RenderOptions &options,
+                 const vector<vector<Pixel>> &image)
+{
+    if (options.use_region && options.write_back)
+    {
+        if (!write_image_region(inputFilename, outputFilename, options.loaded, image))
+        {
+            cout << "The filtered region could not be written back into the full image." << endl;
+            return false;
+        }
+        return true;
+    }
+    return write_image(outputFilename, image, options.format);
 }
 
-// Process 5 - rotates image clockwise by a specified number of multiples of 90 degrees
-vector<vector<Pixel>> process_5(const vector<vector<Pixel>> &image, int number)
+/**
+ * Applies a filter to the working image and writes the result.
+ * In preview mode the working image is the decimated preview: the filter is
+ * run on it and written next to the output, and only if the user accepts is
+ * the full image decoded and run through the same filters for the final output.
+ * A filter that only looks at each pixel's color is applied to the palette of
+ * a palettized input instead, and written back out with the same indices.
+ * @param session        the session, whose working image is replaced by the
+ *                       result when history is on
+ * @param outputFilename the output BMP filename
+ * @param filter         the filter to apply
+ * @param colorOnly      whether the filter depends on nothing but each pixel's color
+ * @param indexedFilter  a version of the filter that emits palette indices, used
+ *                       for indexed output when no RGB result is needed
+ * @return true if the output was written
+ */
+bool renderOutput(Session &session, const string &outputFilename, const Filter &filter, bool colorOnly = false,
+                  const IndexedFilter &indexedFilter = nullptr)
 {
-    vector<vector<Pixel>> new_image = image;
+    const RenderOptions &options = session.options;
+    History *history = session.use_history ? &session.history : nullptr;
+    bool compress = options.format == BMP_INDEXED_RLE;
 
-    // Normalize the number of rotations for optimization
-    number = number % 4;
+    if (colorOnly && session.indexed && !history)
+    {
+        // Filter the palette alone, then restore it for the next filter
+        IndexedImage &indexed = session.indexed_image;
+        vector<Pixel> palette = filter(vector<vector<Pixel>>(1, indexed.palette))[0];
+        palette.swap(indexed.palette);
+        bool written = write_indexed_image(outputFilename, indexed, compress);
+        palette.swap(indexed.palette);
+        return written;
+    }
+    if (session.image.empty())
+    {
+        session.image = expand_indexed(session.indexed_image);
+    }
 
-    for (int i = 0; i < number; ++i)
+    const vector<vector<Pixel>> &image = session.image;
+    const string &inputFilename = session.filename;
+    bool direct_indexed = indexedFilter && options.format != BMP_RGB24 && !history && !options.write_back;
+
+    vector<vector<Pixel>> result;
+    if (options.preview_step > 1 || !direct_indexed)
     {
-        new_image = process_4(new_image);
+        result = filter(image);
     }
 
-    return new_image;
+    if (options.preview_step <= 1)
+    {
+        bool written = direct_indexed ? write_indexed_image(outputFilename, indexedFilter(image), compress)
+                                      : writeOutput(outputFilename, inputFilename, options, result);
+        if (!written)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        string preview = previewFilename(outputFilename);
+        if (!write_image(preview, result))
+        {
+            return false;
+        }
+        cout << "Preview written to " << preview << endl;
+
+        char choice;
+        cout << "Render full resolution output (Y / N): ";
+        cin >> choice;
+        if (tolower(choice) != 'y')
+        {
+            cout << "Full resolution render skipped. \n"
+                 << endl;
+            return false;
+        }
+
+        // Earlier steps in the history are replayed so the full render matches the preview
+        vector<vector<Pixel>> full_image = read_image(inputFilename);
+        if (full_image.empty())
+        {
+            return false;
+        }
+        if (history)
+        {
+            full_image = history_replay(*history, full_image);
+        }
+        bool written = direct_indexed ? write_indexed_image(outputFilename, indexedFilter(full_image), compress)
+                                      : write_image(outputFilename, filter(full_image), options.format);
+        if (!written)
+        {
+            return false;
+        }
+    }
+
+    if (history)
+    {
+        history_push(*history, result, filter);
+        session.image = result;
+    }
+    return true;
 }
 
-// Process 6 - enlarges the image in the x and y direction
-vector<vector<Pixel>> process_6(const vector<vector<Pixel>> &image, int x_scale, int y_scale)
+/**
+ * Loads a palettized BMP and runs its palette through a chain of color
+ * filters, so it can be written palettized with the same indices as the
+ * menu does
+ * Helper function for run_convert() and process_spooled_file()
+ * @param filename    the BMP filename
+ * @param operations  the chain
+ * @param fixed_point whether to use the fixed-point scaling filters
+ * @param indexed     the filtered image, filled in place
+ * @return false if the file is not palettized or a step is not a color filter
+ */
+bool filter_palette(const string &filename, const vector<Operation> &operations, bool fixed_point, IndexedImage &indexed)
 {
-    int num_rows = image.size();
-    int num_columns = image[0].size();
+    return all_of(operations.begin(), operations.end(), operation_color_only) && read_indexed_image(filename, indexed) &&
+           apply_operations_indexed(indexed, operations, fixed_point);
+}
 
-    int new_height = num_rows * y_scale;
-    int new_width = num_columns * x_scale;
+// Watch mode
+// Picks up BMPs as they are completed in a spool directory (written and
+// closed, or renamed into it), runs each through an operation chain, writes
+// the result to the output directory and moves the input to the done or
+// failed directory.
 
-    vector<vector<Pixel>> new_image(new_height, vector<Pixel>(new_width));
+// Settings for watch mode
+struct WatchConfig
+{
+    string spool_dir;
+    string output_dir;
+    string done_dir;
+    string failed_dir;
+    vector<Operation> operations;
+    size_t queue_size; // Files waiting for a worker before the watcher holds back
+    int workers;
+    bool fixed_point;
+    BmpFormat format;
+    long long memory_budget; // Bytes the workers share, or 0 for no limit
+};
+
+// Set from the signal handler to stop watch mode
+volatile sig_atomic_t stop_requested = 0;
+
+/**
+ * Signal handler that asks the long running modes to stop
+ * @param signal the signal number
+ */
+void request_stop(int)
+{
+    stop_requested = 1;
+}
+
+/**
+ * Whether a filename names a BMP, by the same rule as the filename prompts
+ * @param filename the filename
+ * @return true if it ends in .bmp
+ */
+bool isBMPFilename(const string &filename)
+{
+    return filename.size() > 4 && filename.substr(filename.size() - 4) == ".bmp";
+}
+
+/**
+ * Loads, filters and writes one spooled file, then moves it out of the spool.
+ * With a memory budget the file first waits for its estimated peak to be
+ * free. A file whose peak is more than the whole budget is streamed through
+ * in bands if its chain allows that and it is written as a 24-bit BMP, and
+ * otherwise runs alone.
+ * Helper function for run_watch()
+ * @param config the watch settings
+ * @param name   the file's name within the spool directory
+ * @param budget the memory budget, or nullptr for no limit
+ * @return true if the file was processed
+ */
+bool process_spooled_file(const WatchConfig &config, const string &name, MemoryBudget *budget)
+{
+    string input = config.spool_dir + "/" + name;
+    string output = config.output_dir + "/" + name;
+
+    long long reserved = 0;
+    bool streaming = false;
+    BmpInfo info;
+    fstream probe(input, ios::in | ios::binary);
+    if (budget && read_bmp_info(probe, info))
+    {
+        reserved = estimate_peak_bytes(info, config.operations, config.format);
+        // Bands are always written as 24-bit, so other formats run alone
+        streaming = reserved > budget->limit() && info.bits_per_pixel >= 24 && operations_streamable(config.operations) &&
+                    config.format == BMP_RGB24;
+        reserved = budget->acquire(streaming ? estimate_streaming_bytes(info) : reserved);
+    }
+    probe.close();
+
+    bool processed;
+    IndexedImage indexed;
+    if (streaming)
+    {
+        processed = apply_operations_streaming(input, output, config.operations, config.fixed_point);
+    }
+    else if (filter_palette(input, config.operations, config.fixed_point, indexed))
+    {
+        processed = write_indexed_image(output, indexed, config.format == BMP_INDEXED_RLE);
+    }
+    else
+    {
+        ImageStats stats;
+        vector<vector<Pixel>> image = read_image(input, &stats);
+        processed = !image.empty() &&
+                    write_image(output, apply_operations(move(image), config.operations, stats, config.fixed_point), config.format);
+    }
+    if (budget)
+    {
+        budget->release(reserved);
+    }
+
+    string destination = (processed ? config.done_dir : config.failed_dir) + "/" + name;
+    if (rename(input.c_str(), destination.c_str()) != 0)
+    {
+        cerr << "Could not move " << input << " to " << destination << endl;
+    }
+    cout << (processed ? "Processed " : "Failed ") << name << (streaming ? " in bands" : "") << endl;
+    return processed;
+}
+
+#ifdef __linux__
+/**
+ * Queues every BMP already in the spool directory that is not queued yet
+ * Helper function for run_watch()
+ * @param config  the watch settings
+ * @param queue   the work queue
+ * @param pending names queued and not yet finished, guarded by pending_guard
+ */
+void scan_spool(const WatchConfig &config, BoundedQueue<string> &queue, set<string> &pending, mutex &pending_guard)
+{
+    DIR *dir = opendir(config.spool_dir.c_str());
+    if (!dir)
+    {
+        return;
+    }
+    vector<string> names;
+    while (dirent *entry = readdir(dir))
+    {
+        names.push_back(entry->d_name);
+    }
+    closedir(dir);
+
+    sort(names.begin(), names.end());
+    for (const string &name : names)
+    {
+        string path = config.spool_dir + "/" + name;
+        struct stat info;
+        if (!isBMPFilename(name) || stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+        {
+            continue;
+        }
+        {
+            lock_guard<mutex> lock(pending_guard);
+            if (!pending.insert(name).second)
+            {
+                continue;
+            }
+        }
+        queue.push(name);
+    }
+}
+
+/**
+ * Runs watch mode until SIGINT or SIGTERM
+ * @param config the watch settings
+ * @return the process exit status
+ */
+int run_watch(const WatchConfig &config)
+{
+    for (const string &dir : {config.output_dir, config.done_dir, config.failed_dir})
+    {
+        mkdir(dir.c_str(), 0755);
+    }
+
+    int notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify < 0 || inotify_add_watch(notify, config.spool_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        cerr << "Could not watch " << config.spool_dir << endl;
+        return 1;
+    }
+
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+
+    BoundedQueue<string> queue(config.queue_size);
+    set<string> pending;
+    mutex pending_guard;
+    unique_ptr<MemoryBudget> budget(config.memory_budget > 0 ? new MemoryBudget(config.memory_budget) : nullptr);
+
+    vector<thread> workers;
+    for (int i = 0; i < config.workers; ++i)
+    {
+        workers.push_back(thread([&]
+                                 {
+            string name;
+            while (queue.pop(name))
+            {
+                process_spooled_file(config, name, budget.get());
+                lock_guard<mutex> lock(pending_guard);
+                pending.erase(name);
+            } }));
+    }
+
+    // Files that arrived before the watch started
+    cout << "Watching " << config.spool_dir << endl;
+    scan_spool(config, queue, pending, pending_guard);
+
+    // While the queue is full push() blocks, and new events wait in the kernel queue
+    vector<char> buffer(64 * 1024);
+    while (!stop_requested)
+    {
+        pollfd poll_fd = {notify, POLLIN, 0};
+        if (poll(&poll_fd, 1, 500) <= 0)
+        {
+            continue;
+        }
+
+        ssize_t length = read(notify, buffer.data(), buffer.size());
+        for (ssize_t offset = 0; offset < length;)
+        {
+            const inotify_event *event = reinterpret_cast<const inotify_event *>(&buffer[offset]);
+            offset += sizeof(inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // Events were dropped, so look at the whole directory again
+                scan_spool(config, queue, pending, pending_guard);
+                continue;
+            }
+            string name = event->len > 0 ? event->name : "";
+            if (!isBMPFilename(name))
+            {
+                continue;
+            }
+            {
+                lock_guard<mutex> lock(pending_guard);
+                if (!pending.insert(name).second)
+                {
+                    continue;
+                }
+            }
+            queue.push(name);
+        }
+    }
+
+    // Finish what is already queued
+    cout << "Stopping, finishing queued files" << endl;
+    queue.close();
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    close(notify);
+    return 0;
+}
+#else
+int run_watch(const WatchConfig &)
+{
+    cerr << "Watch mode needs inotify, which is only available on Linux" << endl;
+    return 1;
+}
+#endif
+
+// Stream mode
+// Filters a stream of raw video frames from stdin to stdout, so it can sit
+// between two ffmpeg processes. Frames are either packed RGB24 of a size given
+// on the command line, or a YUV4MPEG2 stream (4:2:0 or 4:4:4), converted to
+// pixels and back with the BT.601 video range formulas. Several frames are
+// filtered at once on worker threads and written back in their original order.
+
+// Settings for stream mode
+struct StreamConfig
+{
+    bool y4m;      // YUV4MPEG2 rather than raw RGB24
+    int width;     // Frame size, for raw RGB24
+    int height;
+    vector<Operation> operations;
+    int workers;
+    bool fixed_point;
+};
+
+// Layout of the frames of a stream
+struct FrameFormat
+{
+    int width;
+    int height;
+    bool y4m;
+    bool chroma420; // 4:2:0 chroma for YUV4MPEG2, otherwise 4:4:4
+    size_t frame_bytes;
+};
+
+/**
+ * Works out the byte size of one frame
+ * @param format the frame format, frame_bytes filled in place
+ */
+void set_frame_bytes(FrameFormat &format)
+{
+    size_t luma = static_cast<size_t>(format.width) * format.height;
+    if (!format.y4m)
+    {
+        format.frame_bytes = luma * 3;
+    }
+    else if (format.chroma420)
+    {
+        format.frame_bytes = luma + 2 * static_cast<size_t>((format.width + 1) / 2) * ((format.height + 1) / 2);
+    }
+    else
+    {
+        format.frame_bytes = luma * 3;
+    }
+}
+
+/**
+ * Clamps a value to a byte
+ * Helper function for the frame converters
+ */
+inline unsigned char clamp_byte(int value)
+{
+    return static_cast<unsigned char>(min(255, max(0, value)));
+}
+
+/**
+ * Converts one frame from stream bytes to pixels, reusing the image's storage
+ * @param data   the frame bytes
+ * @param format the frame format
+ * @param image  the image, resized if needed and filled in place
+ * @param stats  if not nullptr, filled with the statistics of the frame
+ */
+void frame_to_pixels(const unsigned char *data, const FrameFormat &format, vector<vector<Pixel>> &image, ImageStats *stats)
+{
+    int width = format.width;
+    int height = format.height;
+    if (static_cast<int>(image.size()) != height || image[0].size() != static_cast<size_t>(width))
+    {
+        image.assign(height, vector<Pixel>(width));
+    }
+    if (stats)
+    {
+        *stats = ImageStats();
+    }
+
+    const unsigned char *y_plane = data;
+    int chroma_width = format.chroma420 ? (width + 1) / 2 : width;
+    int chroma_height = format.chroma420 ? (height + 1) / 2 : height;
+    const unsigned char *u_plane = data + static_cast<size_t>(width) * height;
+    const unsigned char *v_plane = u_plane + static_cast<size_t>(chroma_width) * chroma_height;
+
+    for (int row = 0; row < height; ++row)
+    {
+        for (int col = 0; col < width; ++col)
+        {
+            Pixel &p = image[row][col];
+            if (!format.y4m)
+            {
+                const unsigned char *rgb = data + (static_cast<size_t>(row) * width + col) * 3;
+                p = {rgb[0], rgb[1], rgb[2]};
+            }
+            else
+            {
+                size_t chroma = format.chroma420 ? static_cast<size_t>(row / 2) * chroma_width + col / 2
+                                                 : static_cast<size_t>(row) * width + col;
+                int c = y_plane[static_cast<size_t>(row) * width + col] - 16;
+                int d = u_plane[chroma] - 128;
+                int e = v_plane[chroma] - 128;
+                p.red = clamp_byte((298 * c + 409 * e + 128) >> 8);
+                p.green = clamp_byte((298 * c - 100 * d - 208 * e + 128) >> 8);
+                p.blue = clamp_byte((298 * c + 516 * d + 128) >> 8);
+            }
+            if (stats)
+            {
+                add_to_stats(*stats, p);
+            }
+        }
+    }
+    if (stats)
+    {
+        finish_stats(*stats);
+    }
+}
+
+/**
+ * Converts a filtered image back to stream bytes. Channel values are taken
+ * modulo 256, as write_image() stores them.
+ * @param image  the image
+ * @param format the frame format, with the image's size
+ * @param data   the frame bytes, resized and filled in place
+ */
+void pixels_to_frame(const vector<vector<Pixel>> &image, const FrameFormat &format, vector<unsigned char> &data)
+{
+    int width = format.width;
+    int height = format.height;
+    data.resize(format.frame_bytes);
+
+    if (!format.y4m)
+    {
+        unsigned char *rgb = data.data();
+        for (int row = 0; row < height; ++row)
+        {
+            for (const Pixel &p : image[row])
+            {
+                *rgb++ = p.red;
+                *rgb++ = p.green;
+                *rgb++ = p.blue;
+            }
+        }
+        return;
+    }
+
+    int chroma_width = format.chroma420 ? (width + 1) / 2 : width;
+    int chroma_height = format.chroma420 ? (height + 1) / 2 : height;
+    unsigned char *y_plane = data.data();
+    unsigned char *u_plane = y_plane + static_cast<size_t>(width) * height;
+    unsigned char *v_plane = u_plane + static_cast<size_t>(chroma_width) * chroma_height;
+
+    for (int row = 0; row < height; ++row)
+    {
+        for (int col = 0; col < width; ++col)
+        {
+            const Pixel &p = image[row][col];
+            int r = (unsigned char)p.red, g = (unsigned char)p.green, b = (unsigned char)p.blue;
+            y_plane[static_cast<size_t>(row) * width + col] = clamp_byte(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        }
+    }
+
+    // Chroma from the average color of each 2x2 block (or each pixel for 4:4:4)
+    int block = format.chroma420 ? 2 : 1;
+    for (int chroma_row = 0; chroma_row < chroma_height; ++chroma_row)
+    {
+        for (int chroma_col = 0; chroma_col < chroma_width; ++chroma_col)
+        {
+            int r = 0, g = 0, b = 0, count = 0;
+            for (int row = chroma_row * block; row < min(height, (chroma_row + 1) * block); ++row)
+            {
+                for (int col = chroma_col * block; col < min(width, (chroma_col + 1) * block); ++col)
+                {
+                    const Pixel &p = image[row][col];
+                    r += (unsigned char)p.red;
+                    g += (unsigned char)p.green;
+                    b += (unsigned char)p.blue;
+                    count++;
+                }
+            }
+            r /= count;
+            g /= count;
+            b /= count;
+            size_t index = static_cast<size_t>(chroma_row) * chroma_width + chroma_col;
+            u_plane[index] = clamp_byte(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            v_plane[index] = clamp_byte(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+}
+
+/**
+ * Builds a vignette for a fixed frame size, with the scaling factor of every
+ * position worked out once. The results match process_1 exactly, as the
+ * factors come from the same expression.
+ * @param num_rows    the frame height
+ * @param num_columns the frame width
+ * @return the vignette filter, which falls back to process_1 for other sizes
+ */
+Filter prepared_vignette(int num_rows, int num_columns)
+{
+    double center_row = num_rows / 2;
+    double center_col = num_columns / 2;
+    shared_ptr<vector<double>> weights = make_shared<vector<double>>(static_cast<size_t>(num_rows) * num_columns);
+    for (int row = 0; row < num_rows; ++row)
+    {
+        for (int col = 0; col < num_columns; ++col)
+        {
+            double distance = sqrt(pow(col - center_col, 2) + pow(row - center_row, 2));
+            (*weights)[static_cast<size_t>(row) * num_columns + col] = (num_rows - distance) / num_rows;
+        }
+    }
+
+    return [weights, num_rows, num_columns](const vector<vector<Pixel>> &image)
+    {
+        if (static_cast<int>(image.size()) != num_rows || static_cast<int>(image[0].size()) != num_columns)
+        {
+            return process_1(image);
+        }
+
+        vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+        const double *scaling_factor = weights->data();
+        for (int row = 0; row < num_rows; ++row)
+        {
+            for (int col = 0; col < num_columns; ++col, ++scaling_factor)
+            {
+                new_image[row][col].red = static_cast<int>(image[row][col].red * *scaling_factor);
+                new_image[row][col].green = static_cast<int>(image[row][col].green * *scaling_factor);
+                new_image[row][col].blue = static_cast<int>(image[row][col].blue * *scaling_factor);
+            }
+        }
+        return new_image;
+    };
+}
+
+/**
+ * Reads a line from a stream up to a newline, for the YUV4MPEG2 headers
+ * @param file the stream
+ * @param line the line without its newline
+ * @return false at end of stream
+ */
+bool read_header_line(FILE *file, string &line)
+{
+    line.clear();
+    int c;
+    while ((c = fgetc(file)) != EOF && c != '\n')
+    {
+        line += static_cast<char>(c);
+    }
+    return c == '\n';
+}
+
+// One frame in flight in stream mode
+struct FrameSlot
+{
+    long long sequence;
+    vector<unsigned char> input;  // Frame bytes as read, reused from frame to frame
+    vector<vector<Pixel>> image;  // Decoded frame, reused from frame to frame
+    vector<unsigned char> output; // Filtered frame bytes
+    FrameFormat output_format;
+};
+
+/**
+ * Runs stream mode until the input ends
+ * @param config the stream settings
+ * @return the process exit status
+ */
+int run_stream(const StreamConfig &config)
+{
+    FrameFormat format = {config.width, config.height, config.y4m, false, 0};
+    string header_tail; // YUV4MPEG2 header fields passed through unchanged
+
+    if (config.y4m)
+    {
+        string header;
+        if (!read_header_line(stdin, header) || header.compare(0, 9, "YUV4MPEG2") != 0)
+        {
+            cerr << "Input is not a YUV4MPEG2 stream" << endl;
+            return 1;
+        }
+        format.chroma420 = true;
+        istringstream fields(header.substr(9));
+        string field;
+        while (fields >> field)
+        {
+            if (field[0] == 'W')
+            {
+                format.width = atoi(field.c_str() + 1);
+            }
+            else if (field[0] == 'H')
+            {
+                format.height = atoi(field.c_str() + 1);
+            }
+            else
+            {
+                if (field[0] == 'C')
+                {
+                    if (field.compare(0, 4, "C444") == 0)
+                    {
+                        format.chroma420 = false;
+                    }
+                    else if (field.compare(0, 4, "C420") != 0)
+                    {
+                        cerr << "Only 4:2:0 and 4:4:4 YUV4MPEG2 streams are supported" << endl;
+                        return 1;
+                    }
+                }
+                header_tail += " " + field;
+            }
+        }
+    }
+    if (format.width < 1 || format.height < 1)
+    {
+        cerr << "Stream frame size must be given as --size WIDTHxHEIGHT" << endl;
+        return 1;
+    }
+    set_frame_bytes(format);
+
+    // Per-stream work done once: vignettes get their weights for the size of frame they will see
+    bool needs_stats = false;
+    vector<Filter> filters(config.operations.size());
+    FrameFormat output_format = format;
+    for (size_t i = 0; i < config.operations.size(); ++i)
+    {
+        const Operation &operation = config.operations[i];
+        if (operation.process == 1 && !config.fixed_point)
+        {
+            filters[i] = prepared_vignette(output_format.height, output_format.width);
+        }
+        else if (operation.process >= 11 && operation.process <= 13)
+        {
+            needs_stats = true; // Built for each frame from its own statistics
+        }
+        else
+        {
+            filters[i] = operation_filter(operation, ImageStats(), config.fixed_point);
+        }
+        operation_size(operation, output_format.width, output_format.height);
+    }
+    set_frame_bytes(output_format);
+    if (config.y4m)
+    {
+        fprintf(stdout, "YUV4MPEG2 W%d H%d%s\n", output_format.width, output_format.height, header_tail.c_str());
+    }
+    else
+    {
+        cerr << "Output frames are " << output_format.width << "x" << output_format.height << " RGB24" << endl;
+    }
+
+    // Slots cycle from the reader to the workers to the writer and back
+    int slot_count = config.workers * 2;
+    vector<FrameSlot> slots(slot_count);
+    BoundedQueue<int> free_slots(slot_count);
+    BoundedQueue<int> work(slot_count);
+    for (int i = 0; i < slot_count; ++i)
+    {
+        free_slots.push(i);
+    }
+
+    mutex done_guard;
+    condition_variable done_changed;
+    map<long long, int> done; // Filtered frames waiting for their turn, by sequence
+    long long total_frames = -1;
+
+    vector<thread> workers;
+    for (int i = 0; i < config.workers; ++i)
+    {
+        workers.push_back(thread([&]
+                                 {
+            int index;
+            ImageStats stats;
+            while (work.pop(index))
+            {
+                FrameSlot &slot = slots[index];
+                frame_to_pixels(slot.input.data(), format, slot.image, needs_stats ? &stats : nullptr);
+
+                vector<vector<Pixel>> result;
+                const vector<vector<Pixel>> *current = &slot.image;
+                for (size_t step = 0; step < filters.size(); ++step)
+                {
+                    const Filter &filter = filters[step] ? filters[step] : operation_filter(config.operations[step], stats);
+                    result = filter(*current);
+                    current = &result;
+                }
+                pixels_to_frame(*current, output_format, slot.output);
+
+                lock_guard<mutex> lock(done_guard);
+                done[slot.sequence] = index;
+                done_changed.notify_all();
+            } }));
+    }
+
+    thread writer([&]
+                  {
+        for (long long next = 0;; ++next)
+        {
+            int index;
+            {
+                unique_lock<mutex> lock(done_guard);
+                done_changed.wait(lock, [&]
+                                  { return done.count(next) || total_frames == next; });
+                if (!done.count(next))
+                {
+                    break;
+                }
+                index = done[next];
+                done.erase(next);
+            }
+            if (config.y4m)
+            {
+                fputs("FRAME\n", stdout);
+            }
+            fwrite(slots[index].output.data(), 1, slots[index].output.size(), stdout);
+            free_slots.push(index);
+        }
+        fflush(stdout); });
+
+    // Read frames until the input ends
+    long long sequence = 0;
+    string frame_header;
+    while (true)
+    {
+        if (config.y4m && (!read_header_line(stdin, frame_header) || frame_header.compare(0, 5, "FRAME") != 0))
+        {
+            break;
+        }
+        int index = 0;
+        free_slots.pop(index);
+        FrameSlot &slot = slots[index];
+        slot.input.resize(format.frame_bytes);
+        if (fread(slot.input.data(), 1, format.frame_bytes, stdin) != format.frame_bytes)
+        {
+            break;
+        }
+        slot.sequence = sequence++;
+        work.push(index);
+    }
+
+    work.close();
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    {
+        lock_guard<mutex> lock(done_guard);
+        total_frames = sequence;
+        done_changed.notify_all();
+    }
+    writer.join();
+    cerr << sequence << " frames processed" << endl;
+    return 0;
+}
+
+// Single image mode
+// Reads one BMP, runs it through an operation chain and writes the result,
+// without the menu. Either end may be "-" for stdin or stdout, so that several
+// runs can be chained with pipes instead of temporary files.
+
+// One output of single image mode and the chain that makes it
+struct OutputJob
+{
+    string filename;
+    vector<Operation> operations;
+};
+
+// Settings for single image mode
+struct ConvertConfig
+{
+    string input;  // BMP filename, or "-" for stdin
+    string output; // BMP filename, or "-" for stdout
+    vector<Operation> operations;
+    bool fixed_point;
+    BmpFormat format;
+    vector<OutputJob> jobs; // Further outputs from the same input, given with --job
+};
+
+/**
+ * Whether a command line filename names a BMP or one of the standard streams
+ * @param filename the filename
+ * @return true if it ends in .bmp or is "-"
+ */
+bool isBMPPath(const string &filename)
+{
+    return filename == "-" || isBMPFilename(filename);
+}
+
+/**
+ * Runs single image mode
+ * @param config the settings
+ * @return the exit status
+ */
+int run_convert(const ConvertConfig &config)
+{
+    // With nothing to change, a 24-bit input goes to a pipe as it is
+    BmpInfo info;
+    fstream probe;
+    if (config.input != "-" && config.output == "-" && config.operations.empty() && config.format == BMP_RGB24)
+    {
+        probe.open(config.input, ios::in | ios::binary);
+        if (probe.is_open() && read_bmp_info(probe, info) && info.bits_per_pixel == 24)
+        {
+            probe.close();
+            return copy_image_stream(config.input, stdout) ? 0 : 1;
+        }
+    }
+
+    ImageStats stats;
+    vector<vector<Pixel>> image;
+    IndexedImage indexed;
+    bool palettized = config.input != "-" && filter_palette(config.input, config.operations, config.fixed_point, indexed);
+    if (!palettized)
+    {
+        image = config.input == "-" ? read_image_stream(stdin, &stats) : read_image(config.input, &stats);
+        if (image.empty())
+        {
+            cerr << "Could not read a BMP image from " << (config.input == "-" ? "stdin" : config.input) << endl;
+            return 1;
+        }
+        image = apply_operations(image, config.operations, stats, config.fixed_point);
+    }
+
+    bool written;
+    if (palettized && config.output == "-")
+    {
+        vector<unsigned char> bytes = encode_indexed_image(indexed, config.format == BMP_INDEXED_RLE);
+        written = fwrite(bytes.data(), 1, bytes.size(), stdout) == bytes.size() && fflush(stdout) == 0;
+    }
+    else if (palettized)
+    {
+        written = write_indexed_image(config.output, indexed, config.format == BMP_INDEXED_RLE);
+    }
+    else
+    {
+        written = config.output == "-" ? write_image_stream(stdout, image, config.format)
+                                       : write_image(config.output, image, config.format);
+    }
+    if (!written)
+    {
+        cerr << "Could not write the BMP image to " << (config.output == "-" ? "stdout" : config.output) << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Fan-out
+// Writes several outputs from one input, each with its own operation chain.
+// The chains are merged into a tree in which chains starting with the same
+// steps share the nodes for those steps, so the input is decoded once and
+// every distinct prefix is computed once. Each node writes its outputs as soon
+// as its image is ready, then hands the image to its children, which run on
+// threads of their own while any are spare. When several children of a node
+// look at the sum of each pixel's channels (grayscale and the high contrast
+// filters), the node works the sums out once for all of them.
+
+// One node of the fan-out tree
+struct JobNode
+{
+    Operation operation;     // The step from the parent's image (the root is the input itself)
+    vector<int> children;    // Indices of the nodes that continue from this one
+    vector<string> outputs;  // Files written from this node's image
+};
+
+// Sum of the red, green and blue values of each pixel
+typedef vector<vector<int>> ChannelSums;
+
+/**
+ * Adds up the channels of each pixel
+ * @param image the image
+ * @return the sums
+ */
+ChannelSums channel_sums(const vector<vector<Pixel>> &image)
+{
+    ChannelSums sums(image.size(), vector<int>(image[0].size()));
+    for (size_t row = 0; row < image.size(); ++row)
+    {
+        for (size_t col = 0; col < image[row].size(); ++col)
+        {
+            const Pixel &p = image[row][col];
+            sums[row][col] = p.red + p.green + p.blue;
+        }
+    }
+    return sums;
+}
+
+// Process 3 (shared sums) - grayscale from the channel sums
+vector<vector<Pixel>> process_3_sums(const ChannelSums &sums)
+{
+    vector<vector<Pixel>> new_image(sums.size(), vector<Pixel>(sums[0].size()));
+    for (size_t row = 0; row < sums.size(); ++row)
+    {
+        for (size_t col = 0; col < sums[row].size(); ++col)
+        {
+            int gray_value = sums[row][col] / 3;
+            new_image[row][col] = {gray_value, gray_value, gray_value};
+        }
+    }
+    return new_image;
+}
+
+// Process 7 (shared sums) - high contrast from the channel sums
+vector<vector<Pixel>> process_7_sums(const ChannelSums &sums, int threshold = 255 / 2)
+{
+    vector<vector<Pixel>> new_image(sums.size(), vector<Pixel>(sums[0].size()));
+    for (size_t row = 0; row < sums.size(); ++row)
+    {
+        for (size_t col = 0; col < sums[row].size(); ++col)
+        {
+            int value = sums[row][col] / 3 >= threshold ? 255 : 0;
+            new_image[row][col] = {value, value, value};
+        }
+    }
+    return new_image;
+}
+
+// Process 10 (shared sums) - black, white, red, green, blue, looking at the channels only in the middle range
+vector<vector<Pixel>> process_10_sums(const vector<vector<Pixel>> &image, const ChannelSums &sums)
+{
+    vector<vector<Pixel>> new_image(sums.size(), vector<Pixel>(sums[0].size()));
+    for (size_t row = 0; row < sums.size(); ++row)
+    {
+        for (size_t col = 0; col < sums[row].size(); ++col)
+        {
+            int total_color = sums[row][col];
+            int value = total_color >= 550 ? 255 : 0;
+            new_image[row][col] = {value, value, value};
+
+            // Adjust for dominant color
+            if (total_color > 150 && total_color < 550)
+            {
+                const Pixel &p = image[row][col];
+                int max_color = max({p.red, p.green, p.blue});
+                new_image[row][col] = {max_color == p.red ? 255 : 0, max_color == p.green ? 255 : 0,
+                                       max_color == p.blue ? 255 : 0};
+            }
+        }
+    }
+    return new_image;
+}
+
+/**
+ * Whether an operation can start from the channel sums
+ * @param operation the operation
+ * @return true for grayscale, black, white, red, green, blue and the high contrast processes
+ */
+bool operation_uses_sums(const Operation &operation)
+{
+    return operation.process == 3 || operation.process == 7 || operation.process == 10 || operation.process == 13;
+}
+
+/**
+ * Builds the filter for one node of the fan-out tree
+ * @param operation   the operation
+ * @param stats       statistics of the input image, used by the automatic processes
+ * @param fixed_point whether to use the fixed-point scaling filters
+ * @param sums        channel sums of the parent's image, or nullptr
+ * @return the filter
+ */
+Filter job_filter(const Operation &operation, const ImageStats &stats, bool fixed_point, const ChannelSums *sums)
+{
+    if (!sums || !operation_uses_sums(operation))
+    {
+        return operation_filter(operation, stats, fixed_point);
+    }
+
+    int threshold = operation.process == 13 ? auto_threshold(stats)
+                    : operation.params.empty() ? 255 / 2
+                                               : static_cast<int>(operation.params[0]);
+    switch (operation.process)
+    {
+    case 3:
+        return [sums](const vector<vector<Pixel>> &)
+        { return process_3_sums(*sums); };
+    case 10:
+        return [sums](const vector<vector<Pixel>> &image)
+        { return process_10_sums(image, *sums); };
+    default:
+        return [sums, threshold](const vector<vector<Pixel>> &)
+        { return process_7_sums(*sums, threshold); };
+    }
+}
+
+/**
+ * Merges the chains of the outputs into a tree with shared prefixes
+ * @param jobs the outputs
+ * @return the nodes, the root first
+ */
+vector<JobNode> build_job_tree(const vector<OutputJob> &jobs)
+{
+    vector<JobNode> nodes(1);
+    for (const OutputJob &job : jobs)
+    {
+        int node = 0;
+        for (const Operation &operation : job.operations)
+        {
+            int next = -1;
+            for (int child : nodes[node].children)
+            {
+                if (nodes[child].operation.process == operation.process && nodes[child].operation.params == operation.params)
+                {
+                    next = child;
+                }
+            }
+            if (next < 0)
+            {
+                next = nodes.size();
+                nodes[node].children.push_back(next);
+                nodes.push_back({operation, {}, {}});
+            }
+            node = next;
+        }
+        nodes[node].outputs.push_back(job.filename);
+    }
+    return nodes;
+}
+
+// State shared by every node of a fan-out run
+struct FanoutRun
+{
+    vector<JobNode> nodes;
+    ImageStats stats;
+    bool fixed_point;
+    BmpFormat format;
+    atomic<int> spare_threads; // Threads that may still be started for branches
+    atomic<bool> failed;
+    mutex report_guard;
+};
+
+/**
+ * Takes one of the spare threads of a run, if any are left
+ * Helper function for run_job_node()
+ * @param run the run
+ * @return true if a thread was taken
+ */
+bool take_spare_thread(FanoutRun &run)
+{
+    int spare = run.spare_threads;
+    while (spare > 0)
+    {
+        if (run.spare_threads.compare_exchange_weak(spare, spare - 1))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Writes the outputs of a node, then runs its children on its image
+ * Helper function for run_fanout()
+ * @param run   the run
+ * @param index the node
+ * @param image the node's image
+ */
+void run_job_node(FanoutRun &run, int index, const vector<vector<Pixel>> &image)
+{
+    const JobNode &node = run.nodes[index];
+    for (const string &output : node.outputs)
+    {
+        bool written = write_image(output, image, run.format);
+        lock_guard<mutex> lock(run.report_guard);
+        cout << (written ? "Wrote " : "Could not write ") << output << endl;
+        run.failed = run.failed || !written;
+    }
+
+    int sharing = count_if(node.children.begin(), node.children.end(), [&](int child)
+                           { return operation_uses_sums(run.nodes[child].operation); });
+    ChannelSums sums;
+    if (sharing > 1)
+    {
+        sums = channel_sums(image);
+    }
+
+    // Every child but the last gets a thread if one is spare; the last runs on this one.
+    // Branch threads come out of the same thread_count() budget as the filters,
+    // so while branches run side by side each keeps its filters to its own thread.
+    vector<thread> branches;
+    for (size_t i = 0; i < node.children.size(); i++)
+    {
+        int child = node.children[i];
+        auto branch = [&run, &image, &sums, child]()
+        {
+            Filter filter = job_filter(run.nodes[child].operation, run.stats, run.fixed_point, sums.empty() ? nullptr : &sums);
+            run_job_node(run, child, filter(image));
+        };
+
+        if (i + 1 < node.children.size() && take_spare_thread(run))
+        {
+            auto release = [&run, branch]()
+            {
+                set_thread_limit(1);
+                branch();
+                run.spare_threads++;
+            };
+            branches.push_back(thread(release));
+        }
+        else if (!branches.empty())
+        {
+            int limit = set_thread_limit(1);
+            branch();
+            set_thread_limit(limit);
+        }
+        else
+        {
+            branch();
+        }
+    }
+    for (auto &branch : branches)
+    {
+        branch.join();
+    }
+}
+
+/**
+ * Runs single image mode with several outputs
+ * @param config the settings, with the outputs in jobs
+ * @return the exit status
+ */
+int run_fanout(const ConvertConfig &config)
+{
+    FanoutRun run;
+    run.nodes = build_job_tree(config.jobs);
+    run.fixed_point = config.fixed_point;
+    run.format = config.format;
+    run.spare_threads = thread_count() - 1;
+    run.failed = false;
+
+    vector<vector<Pixel>> image = config.input == "-" ? read_image_stream(stdin, &run.stats) : read_image(config.input, &run.stats);
+    if (image.empty())
+    {
+        cerr << "Could not read a BMP image from " << (config.input == "-" ? "stdin" : config.input) << endl;
+        return 1;
+    }
+
+    run_job_node(run, 0, image);
+    return run.failed ? 1 : 0;
+}
+
+// Pyramid mode
+// Cuts one BMP into the tiles of a deep-zoom pyramid, streaming it once.
+
+/**
+ * Runs pyramid mode
+ * @param input  BMP filename, or "-" for stdin
+ * @param config the pyramid settings
+ * @return the exit status
+ */
+int run_pyramid(const string &input, const PyramidConfig &config)
+{
+    for (const Operation &operation : config.operations)
+    {
+        if (!operation_pyramid(operation))
+        {
+            cerr << "--pyramid can only apply color filters that do not need the image statistics" << endl;
+            return 1;
+        }
+    }
+
+    FILE *file = input == "-" ? stdin : fopen(input.c_str(), "rb");
+    if (!file)
+    {
+        cerr << "Could not open " << input << endl;
+        return 1;
+    }
+#ifdef __linux__
+    mkdir(config.directory.c_str(), 0755);
+#endif
+    int levels = 0;
+    bool written = write_pyramid(file, config, levels);
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+    if (!written)
+    {
+        cerr << "Could not build a pyramid from " << (input == "-" ? "stdin" : input)
+             << "; it needs a 24 or 32-bit BMP and a writable " << config.directory << endl;
+        return 1;
+    }
+    cerr << levels << " levels written to " << config.directory << ", the full image as level " << levels - 1 << endl;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    string bmpFilename;
+    Session session;
+    RenderOptions &options = session.options;
+    options = {1, false, {0, 0, 0, 0}, false, {0, 0, 0, 0}, BMP_RGB24};
+    session.use_history = false;
+    bool isImageLoaded = false;
+    bool autoTune = false;
+    bool retune = false;
+
+    // Settings tuned for this host, unless they were measured on another CPU
+    string profilePath = default_profile_path();
+    TuningProfile profile;
+    bool staleProfile = false;
+    if (load_profile(profilePath, profile))
+    {
+        staleProfile = profile.cpu_model != cpu_model();
+        if (!staleProfile)
+        {
+            set_tuning(profile);
+        }
+    }
+    bool useFixedPoint = false;
+    string operationSpec;
+    // Worker counts stay 0 until the profile is settled, since --retune may change thread_count()
+    WatchConfig watch = {"", "", "", "", {}, 16, 0, false, BMP_RGB24, 0};
+    string streamFormat;
+    StreamConfig stream = {false, 0, 0, {}, 0, false};
+    ConvertConfig convert = {"", "", {}, false, BMP_RGB24, {}};
+    PyramidConfig pyramid = {"", 256, {}, false, BMP_RGB24};
+
+    // Command line options
+    // --fixed-point        use the fixed-point scaling filters
+    // --verify-fixed-point compare the fixed-point filters against the double filters and exit
+    // --auto-tune          time the settings that vary between machines, save this host's profile and exit
+    // --retune             re-tune first if the saved profile was measured on another CPU
+    // --preview N          load every Nth row and column, rendering full resolution only on request
+    // --roi x,y,w,h        load and filter only this region of the image
+    // --roi-write-back     write the filtered region into a copy of the full image
+    // --history            chain filters onto the working image, with undo and redo
+    // --indexed            write outputs with at most 256 colors as 1, 4 or 8 bit palettized BMPs
+    // --rle                as --indexed, run-length encoding them when that is smaller
+    // --ops CHAIN          operation chain for the non-interactive modes, e.g. 3,9:0.5
+    // --watch DIR          process BMPs as they arrive in DIR with the --ops chain
+    // --output-dir DIR     where watch mode writes results (default DIR/out)
+    // --done-dir DIR       where watch mode moves processed inputs (default DIR/done)
+    // --failed-dir DIR     where watch mode moves inputs that failed (default DIR/failed)
+    // --queue N            files watch mode queues before holding back (default 16)
+    // --workers N          threads processing files or frames (default one per core)
+    // --memory-budget MB   memory watch mode's workers share; larger files stream in bands or run alone
+    // --stream FORMAT      filter raw frames from stdin to stdout with the --ops chain; FORMAT is rgb24 or y4m
+    // --size WxH           frame size of an rgb24 stream
+    // --input FILE         filter one BMP with the --ops chain; FILE may be - for stdin
+    // --output FILE        where --input writes its result; FILE may be - for stdout
+    // --job FILE=CHAIN     another output of --input, with its own chain; may be repeated
+    // --pyramid DIR        cut --input into deep-zoom tiles in DIR, applying the --ops color filters
+    // --tile-size N        width and height of the pyramid tiles, an even number (default 256)
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--fixed-point")
+        {
+            useFixedPoint = true;
+        }
+        else if (arg == "--preview" && i + 1 < argc)
+        {
+            options.preview_step = atoi(argv[++i]);
+            if (options.preview_step < 1)
+            {
+                cerr << "Preview step must be a positive integer" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--roi" && i + 1 < argc)
+        {
+            Region &region = options.region;
+            char comma1, comma2, comma3;
+            istringstream roi(argv[++i]);
+            if (!(roi >> region.x >> comma1 >> region.y >> comma2 >> region.width >> comma3 >> region.height) ||
+                comma1 != ',' || comma2 != ',' || comma3 != ',' || region.width < 1 || region.height < 1)
+            {
+                cerr << "Region must be given as x,y,width,height" << endl;
+                return 1;
+            }
+            options.use_region = true;
+        }
+        else if (arg == "--roi-write-back")
+        {
+            options.write_back = true;
+        }
+        else if (arg == "--history")
+        {
+            session.use_history = true;
+        }
+        else if (arg == "--indexed")
+        {
+            options.format = BMP_INDEXED;
+        }
+        else if (arg == "--rle")
+        {
+            options.format = BMP_INDEXED_RLE;
+        }
+        else if (arg == "--ops" && i + 1 < argc)
+        {
+            operationSpec = argv[++i];
+        }
+        else if (arg == "--watch" && i + 1 < argc)
+        {
+            watch.spool_dir = argv[++i];
+        }
+        else if (arg == "--output-dir" && i + 1 < argc)
+        {
+            watch.output_dir = argv[++i];
+        }
+        else if (arg == "--done-dir" && i + 1 < argc)
+        {
+            watch.done_dir = argv[++i];
+        }
+        else if (arg == "--failed-dir" && i + 1 < argc)
+        {
+            watch.failed_dir = argv[++i];
+        }
+        else if (arg == "--queue" && i + 1 < argc)
+        {
+            watch.queue_size = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--memory-budget" && i + 1 < argc)
+        {
+            watch.memory_budget = max(1LL, atoll(argv[++i])) << 20;
+        }
+        else if (arg == "--workers" && i + 1 < argc)
+        {
+            watch.workers = stream.workers = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--stream" && i + 1 < argc)
+        {
+            streamFormat = argv[++i];
+            if (streamFormat != "rgb24" && streamFormat != "y4m")
+            {
+                cerr << "Stream format must be rgb24 or y4m" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--size" && i + 1 < argc)
+        {
+            char separator;
+            istringstream size(argv[++i]);
+            if (!(size >> stream.width >> separator >> stream.height) || separator != 'x')
+            {
+                cerr << "Frame size must be given as WIDTHxHEIGHT" << endl;
+                return 1;
+            }
+        }
+        else if ((arg == "--input" || arg == "--output") && i + 1 < argc)
+        {
+            string filename = argv[++i];
+            if (!isBMPPath(filename))
+            {
+                cerr << "Error: filename must end in .bmp, or be - for the standard streams" << endl;
+                return 1;
+            }
+            (arg == "--input" ? convert.input : convert.output) = filename;
+        }
+        else if (arg == "--job" && i + 1 < argc)
+        {
+            string job = argv[++i];
+            size_t equals = job.find('=');
+            OutputJob output = {job.substr(0, equals), {}};
+            if (equals == string::npos || !isBMPFilename(output.filename) ||
+                (equals + 1 < job.size() && !parse_operations(job.substr(equals + 1), output.operations)))
+            {
+                cerr << "Jobs must be given as FILE.bmp=CHAIN" << endl;
+                return 1;
+            }
+            convert.jobs.push_back(output);
+        }
+        else if (arg == "--pyramid" && i + 1 < argc)
+        {
+            pyramid.directory = argv[++i];
+        }
+        else if (arg == "--tile-size" && i + 1 < argc)
+        {
+            pyramid.tile_size = atoi(argv[++i]);
+            if (pyramid.tile_size < 2 || pyramid.tile_size % 2 != 0)
+            {
+                cerr << "Tile size must be an even number of at least 2" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--auto-tune")
+        {
+            autoTune = true;
+        }
+        else if (arg == "--retune")
+        {
+            retune = true;
+        }
+        else if (arg == "--verify-fixed-point")
+        {
+            return verify_fixed_point() ? 0 : 1;
+        }
+        else
+        {
+            cerr << "Unknown option: " << arg << endl;
+            return 1;
+        }
+    }
 
-    for (int row = 0; row < new_height; ++row)
+    // Tuning reports go to stderr unless tuning is all that was asked for, since stdout may carry an image
+    if (autoTune || (retune && staleProfile))
     {
-        for (int col = 0; col < new_width; ++col)
+        ostream &report = autoTune ? cout : cerr;
+        profile = auto_tune(profilePath + ".scratch.bmp", report);
+        if (!save_profile(profilePath, profile))
         {
-            // Calculate the corresponding pixel in the original image
-            int orig_row = floor(row / static_cast<double>(y_scale));
-            int orig_col = floor(col / static_cast<double>(x_scale));
-
-            // Set the pixel in the new image
-            new_image[row][col] = image[orig_row][orig_col];
+            cerr << "Could not write the profile to " << profilePath << endl;
+            return 1;
+        }
+        report << "Profile written to " << profilePath << endl;
+        if (autoTune)
+        {
+            return 0;
         }
+        set_tuning(profile);
+    }
+    else if (staleProfile)
+    {
+        cerr << "Not using " << profilePath << ", which was tuned on another CPU; run with --auto-tune or --retune" << endl;
+    }
+    if (watch.workers == 0)
+    {
+        watch.workers = stream.workers = thread_count();
     }
 
-    return new_image;
-}
-
-// Process 7 - Convert image to high contrast (black and white only)
-vector<vector<Pixel>> process_7(const vector<vector<Pixel>> &image)
-{
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
+    if (options.write_back && !options.use_region)
+    {
+        cerr << "--roi-write-back needs a region given with --roi" << endl;
+        return 1;
+    }
+    if (options.use_region && options.preview_step > 1)
+    {
+        cerr << "--preview and --roi cannot be combined" << endl;
+        return 1;
+    }
 
-    for (int row = 0; row < num_rows; ++row)
+    // Non-interactive modes
+    vector<Operation> operations;
+    if (!operationSpec.empty() && !parse_operations(operationSpec, operations))
     {
-        for (int col = 0; col < num_columns; ++col)
+        cerr << "Invalid operation chain: " << operationSpec << endl;
+        return 1;
+    }
+    if (!watch.spool_dir.empty())
+    {
+        if (operations.empty())
         {
-            const Pixel &p = image[row][col];
-            int red_value = p.red;
-            int green_value = p.green;
-            int blue_value = p.blue;
-
-            // Calculate Gray Value
-            int gray_value = (red_value + green_value + blue_value) / 3;
-
-            int new_red, new_green, new_blue;
-
-            if (gray_value >= 255 / 2)
-            {
-                new_red = 255;
-                new_green = 255;
-                new_blue = 255;
-            }
-            else
-            {
-                new_red = 0;
-                new_green = 0;
-                new_blue = 0;
-            }
-
-            new_image[row][col].red = new_red;
-            new_image[row][col].green = new_green;
-            new_image[row][col].blue = new_blue;
+            cerr << "--watch needs an operation chain given with --ops" << endl;
+            return 1;
         }
+        watch.operations = operations;
+        watch.fixed_point = useFixedPoint;
+        watch.format = options.format;
+        watch.output_dir = watch.output_dir.empty() ? watch.spool_dir + "/out" : watch.output_dir;
+        watch.done_dir = watch.done_dir.empty() ? watch.spool_dir + "/done" : watch.done_dir;
+        watch.failed_dir = watch.failed_dir.empty() ? watch.spool_dir + "/failed" : watch.failed_dir;
+        return run_watch(watch);
     }
-
-    return new_image;
-}
-
-// Process 8 - Lightens image by a scaling factor
-vector<vector<Pixel>> process_8(const vector<vector<Pixel>> &image, double scaling_factor)
-{
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
-
-    for (int row = 0; row < num_rows; ++row)
+    if (!streamFormat.empty())
     {
-        for (int col = 0; col < num_columns; ++col)
+        if (operations.empty())
         {
-            const Pixel &p = image[row][col];
-            int red_value = p.red;
-            int green_value = p.green;
-            int blue_value = p.blue;
-
-            int new_red = static_cast<int>(255 - (255 - red_value) * scaling_factor);
-            int new_green = static_cast<int>(255 - (255 - green_value) * scaling_factor);
-            int new_blue = static_cast<int>(255 - (255 - blue_value) * scaling_factor);
-
-            new_image[row][col].red = new_red;
-            new_image[row][col].green = new_green;
-            new_image[row][col].blue = new_blue;
+            cerr << "--stream needs an operation chain given with --ops" << endl;
+            return 1;
         }
+        stream.y4m = streamFormat == "y4m";
+        stream.operations = operations;
+        stream.fixed_point = useFixedPoint;
+        return run_stream(stream);
     }
-
-    return new_image;
-}
-
-// Process 9 - Darkens image by a scaling factor
-vector<vector<Pixel>> process_9(const vector<vector<Pixel>> &image, double scaling_factor)
-{
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
-
-    for (int row = 0; row < num_rows; ++row)
+    if (!pyramid.directory.empty())
     {
-        for (int col = 0; col < num_columns; ++col)
+        if (convert.input.empty() || !convert.output.empty() || !convert.jobs.empty())
         {
-            const Pixel &p = image[row][col];
-            int red_value = p.red;
-            int green_value = p.green;
-            int blue_value = p.blue;
-
-            int new_red = static_cast<int>(red_value * scaling_factor);
-            int new_green = static_cast<int>(green_value * scaling_factor);
-            int new_blue = static_cast<int>(blue_value * scaling_factor);
-
-            new_image[row][col].red = new_red;
-            new_image[row][col].green = new_green;
-            new_image[row][col].blue = new_blue;
+            cerr << "--pyramid needs --input, and cannot be combined with --output or --job" << endl;
+            return 1;
         }
+        pyramid.operations = operations;
+        pyramid.fixed_point = useFixedPoint;
+        pyramid.format = options.format;
+        return run_pyramid(convert.input, pyramid);
     }
-
-    return new_image;
-}
-
-// Process 10 - Converts image to only black, white, red, blue, and green
-vector<vector<Pixel>> process_10(const vector<vector<Pixel>> &image)
-{
-    int num_rows = image.size();
-    int num_columns = image[0].size();
-
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel>(num_columns));
-
-    for (int row = 0; row < num_rows; ++row)
+    if (!convert.input.empty() || !convert.output.empty() || !convert.jobs.empty())
     {
-        for (int col = 0; col < num_columns; ++col)
+        if (convert.input.empty() || (convert.output.empty() && convert.jobs.empty()))
         {
-            const Pixel &p = image[row][col];
-            int red_value = p.red;
-            int green_value = p.green;
-            int blue_value = p.blue;
-
-            int total_color = red_value + green_value + blue_value;
-            int new_red, new_green, new_blue;
-
-            // Based on total color value, default to black or white
-            new_red = new_green = new_blue = (total_color >= 550) ? 255 : 0;
-
-            // Adjust for dominant color
-            if (total_color > 150 && total_color < 550)
+            cerr << "--input needs --output or --job, and they need --input" << endl;
+            return 1;
+        }
+        if (options.use_region || options.preview_step > 1 || session.use_history)
+        {
+            cerr << "--input cannot be combined with --preview, --roi or --history" << endl;
+            return 1;
+        }
+        convert.operations = operations;
+        convert.fixed_point = useFixedPoint;
+        convert.format = options.format;
+        if (!convert.jobs.empty())
+        {
+            if (convert.output == "-")
             {
-                int max_color = max({red_value, green_value, blue_value});
-                new_red = (max_color == red_value) ? 255 : 0;
-                new_green = (max_color == green_value) ? 255 : 0;
-                new_blue = (max_color == blue_value) ? 255 : 0;
+                cerr << "--job cannot be combined with --output -" << endl;
+                return 1;
             }
-
-            new_image[row][col].red = new_red;
-            new_image[row][col].green = new_green;
-            new_image[row][col].blue = new_blue;
+            if (!convert.output.empty())
+            {
+                convert.jobs.insert(convert.jobs.begin(), {convert.output, operations});
+            }
+            return run_fanout(convert);
         }
+        return run_convert(convert);
     }
-    return new_image;
-}
-
-int main()
-{
-    string bmpFilename;
-    vector<vector<Pixel>> image;
-    bool isImageLoaded = false;
 
     cout << "CSPB 1300 Image Processing Application" << endl;
     bmpFilename = getValidBMPFilename();
@@ -665,8 +2151,7 @@ int main()
     // File check
     if (!bmpFilename.empty())
     {
-        image = read_image(bmpFilename);
-        isImageLoaded = !image.empty();
+        isImageLoaded = loadImage(session, bmpFilename);
 
         if (!isImageLoaded)
         {
@@ -692,8 +2177,21 @@ int main()
                 "8) Lighten image \n"
                 "9) Darken image \n"
                 "10) Black, white, red, gree, blue \n"
-                "\n"
-                "Q) To quit application \n"
+                "11) Auto levels \n"
+                "12) Clarendon (auto scaling factor) \n"
+                "13) High contrast (auto threshold) \n"
+                "14) Box blur \n"
+                "15) Gaussian blur \n"
+                "16) Sharpen (unsharp mask) \n"
+                "17) Resize \n"
+                "\n";
+        if (session.use_history)
+        {
+            cout << "U) Undo \n"
+                    "R) Redo \n"
+                    "\n";
+        }
+        cout << "Q) To quit application \n"
                 "\n";
 
         cout << "Enter menu selection: ";
@@ -706,6 +2204,24 @@ int main()
             break;
         }
 
+        if (session.use_history && (selection == "U" || selection == "u" || selection == "R" || selection == "r"))
+        {
+            History &history = session.history;
+            bool undo = selection == "U" || selection == "u";
+            if (undo ? history_undo(history, session.image) : history_redo(history, session.image))
+            {
+                cout << (undo ? "Undone" : "Redone") << " (step " << history.position << " of "
+                     << history.entries.size() - 1 << ", history uses " << history_bytes(history) / 1024 << " KB) \n"
+                     << endl;
+            }
+            else
+            {
+                cout << "Nothing to " << (undo ? "undo" : "redo") << ". \n"
+                     << endl;
+            }
+            continue;
+        }
+
         int option;
         try
         {
@@ -733,8 +2249,7 @@ int main()
             // Load image and ensure it loaded correctly
             if (!bmpFilename.empty())
             {
-                image = read_image(bmpFilename);
-                isImageLoaded = !image.empty();
+                isImageLoaded = loadImage(session, bmpFilename);
 
                 if (!isImageLoaded)
                 {
@@ -756,11 +2271,13 @@ int main()
                 break;
             }
 
-            vector<vector<Pixel>> newImage = process_1(image);
-
-            write_image(outputFilename, newImage);
-            cout << "Successfully applied vignette! \n"
-                 << endl;
+            bool written = renderOutput(session, outputFilename, [useFixedPoint](const vector<vector<Pixel>> &input)
+                                        { return useFixedPoint ? process_1_fixed(input) : process_1(input); });
+            if (written)
+            {
+                cout << "Successfully applied vignette! \n"
+                     << endl;
+            }
             break; // continue?
         }
         // Clarendon
@@ -795,11 +2312,13 @@ int main()
                 break;
             }
 
-            vector<vector<Pixel>> newImage = process_2(image, scaling_factor);
-
-            write_image(outputFilename, newImage);
-            cout << "Successfully applied clarendon! \n"
-                 << endl;
+            bool written = renderOutput(session, outputFilename, [useFixedPoint, scaling_factor](const vector<vector<Pixel>> &input)
+                                        { return useFixedPoint ? process_2_fixed(input, scaling_factor) : process_2(input, scaling_factor); }, true);
+            if (written)
+            {
+                cout << "Successfully applied clarendon! \n"
+                     << endl;
+            }
             break;
         }
 
@@ -815,10 +2334,13 @@ int main()
                 break;
             }
 
-            vector<vector<Pixel>> newImage = process_3(image);
-            write_image(outputFilename, newImage);
-            cout << "Successfully applied grayscale! \n"
-                 << endl;
+            bool written = renderOutput(session, outputFilename, [](const vector<vector<Pixel>> &input)
+                                        { return process_3(input); }, true);
+            if (written)
+            {
+                cout << "Successfully applied grayscale! \n"
+                     << endl;
+            }
             break;
         }
 
@@ -834,10 +2356,13 @@ int main()
                 break;
             }
 
-            vector<vector<Pixel>> newImage = process_4(image);
-            write_image(outputFilename, newImage);
-            cout << "Successfully applied 90 degree rotation! \n"
-                 << endl;
+            bool written = renderOutput(session, outputFilename, [](const vector<vector<Pixel>> &input)
+                                        { return process_4(input); });
+            if (written)
+            {
+                cout << "Successfully applied 90 degree rotation! \n"
+                     << endl;
+            }
             break;
         }
 
@@ -881,10 +2406,13 @@ int main()
                 break;
             }
 
-            vector<vector<Pixel>> newImage = process_5(image, rotations);
-            write_image(outputFilename, newImage);
-            cout << "Successfully applied multiple 90 degree rotations! \n"
-                 << endl;
+            bool written = renderOutput(session, outputFilename, [rotations](const vector<vector<Pixel>> &input)
+                                        { return process_5(input, rotations); });
+            if (written)
+            {
+                cout << "Successfully applied multiple 90 degree rotations! \n"
+                     << endl;
+            }
             break;
         }
 
@@ -939,10 +2467,13 @@ int main()
                 break;
             }
 
-            vector<vector<Pixel>> newImage = process_6(image, x_scale, y_scale);
-            write_image(outputFilename, newImage);
-            cout << "Successfully enlarged! \n"
-                 << endl;
+            bool written = renderOutput(session, outputFilename, [x_scale, y_scale](const vector<vector<Pixel>> &input)
+                                        { return process_6(input, x_scale, y_scale); });
+            if (written)
+            {
+                cout << "Successfully enlarged! \n"
+                     << endl;
+            }
             break;
         }
 
@@ -958,10 +2489,15 @@ int main()
                 break;
             }
 
-            vector<vector<Pixel>> newImage = process_7(image);
-            write_image(outputFilename, newImage);
-            cout << "Successfully applied high contrast! \n"
-                 << endl;
+            bool written = renderOutput(session, outputFilename, [](const vector<vector<Pixel>> &input)
+                                        { return process_7(input); }, true,
+                                        [](const vector<vector<Pixel>> &input)
+                                        { return process_7_indexed(input); });
+            if (written)
+            {
+                cout << "Successfully applied high contrast! \n"
+                     << endl;
+            }
             break;
         }
 
@@ -996,10 +2532,13 @@ int main()
                 break;
             }
 
-            vector<vector<Pixel>> newImage = process_8(image, scaling_factor);
-            write_image(outputFilename, newImage);
-            cout << "Successfully lightened! \n"
-                 << endl;
+            bool written = renderOutput(session, outputFilename, [useFixedPoint, scaling_factor](const vector<vector<Pixel>> &input)
+                                        { return useFixedPoint ? process_8_fixed(input, scaling_factor) : process_8(input, scaling_factor); }, true);
+            if (written)
+            {
+                cout << "Successfully lightened! \n"
+                     << endl;
+            }
             break;
         }
 
@@ -1034,10 +2573,13 @@ int main()
                 break;
             }
 
-            vector<vector<Pixel>> newImage = process_9(image, scaling_factor);
-            write_image(outputFilename, newImage);
-            cout << "Successfully darkened! \n"
-                 << endl;
+            bool written = renderOutput(session, outputFilename, [useFixedPoint, scaling_factor](const vector<vector<Pixel>> &input)
+                                        { return useFixedPoint ? process_9_fixed(input, scaling_factor) : process_9(input, scaling_factor); }, true);
+            if (written)
+            {
+                cout << "Successfully darkened! \n"
+                     << endl;
+            }
             break;
         }
         // Black, white, red, green, blue
@@ -1052,12 +2594,192 @@ int main()
                 break;
             }
 
-            vector<vector<Pixel>> newImage = process_10(image);
-            write_image(outputFilename, newImage);
-            cout << "Successfully applied black, white, red, green, blue filter! \n"
-                 << endl;
+            bool written = renderOutput(session, outputFilename, [](const vector<vector<Pixel>> &input)
+                                        { return process_10(input); }, true,
+                                        [](const vector<vector<Pixel>> &input)
+                                        { return process_10_indexed(input); });
+            if (written)
+            {
+                cout << "Successfully applied black, white, red, green, blue filter! \n"
+                     << endl;
+            }
             continue;
         }
+        // Auto levels
+        case 11:
+        {
+            cout << "Auto levels selected" << endl;
+
+            string outputFilename = getValidBMPFilenameOutput();
+
+            if (cancellationCheck(outputFilename))
+            {
+                break;
+            }
+
+            // Filters are kept in the history and replayed later, so they capture copies of what they use
+            const ImageStats &stats = session.stats;
+            bool written = renderOutput(session, outputFilename, [stats](const vector<vector<Pixel>> &input)
+                                        { return process_auto_levels(input, stats); }, true);
+            if (written)
+            {
+                cout << "Successfully applied auto levels! \n"
+                     << endl;
+            }
+            break;
+        }
+
+        // Clarendon with the scaling factor picked from the image
+        case 12:
+        {
+            cout << "Auto clarendon selected (scaling_factor " << auto_clarendon_factor(session.stats) << ")" << endl;
+
+            string outputFilename = getValidBMPFilenameOutput();
+
+            if (cancellationCheck(outputFilename))
+            {
+                break;
+            }
+
+            const ImageStats &stats = session.stats;
+            bool written = renderOutput(session, outputFilename, [stats](const vector<vector<Pixel>> &input)
+                                        { return process_2_auto(input, stats); }, true);
+            if (written)
+            {
+                cout << "Successfully applied clarendon! \n"
+                     << endl;
+            }
+            break;
+        }
+
+        // High contrast with the threshold picked from the image
+        case 13:
+        {
+            cout << "Auto high contrast selected (threshold " << auto_threshold(session.stats) << ")" << endl;
+
+            string outputFilename = getValidBMPFilenameOutput();
+
+            if (cancellationCheck(outputFilename))
+            {
+                break;
+            }
+
+            const ImageStats &stats = session.stats;
+            bool written = renderOutput(session, outputFilename, [stats](const vector<vector<Pixel>> &input)
+                                        { return process_7_auto(input, stats); }, true,
+                                        [stats](const vector<vector<Pixel>> &input)
+                                        { return process_7_indexed(input, auto_threshold(stats)); });
+            if (written)
+            {
+                cout << "Successfully applied high contrast! \n"
+                     << endl;
+            }
+            break;
+        }
+
+        // Box blur
+        case 14:
+        {
+            cout << "Box blur selected" << endl;
+            int radius = static_cast<int>(getValidNumber("Please enter radius in pixels (e.g. 3): "));
+
+            string outputFilename = getValidBMPFilenameOutput();
+
+            if (cancellationCheck(outputFilename))
+            {
+                break;
+            }
+
+            bool written = renderOutput(session, outputFilename, [radius](const vector<vector<Pixel>> &input)
+                                        { return process_box_blur(input, radius); });
+            if (written)
+            {
+                cout << "Successfully blurred! \n"
+                     << endl;
+            }
+            break;
+        }
+
+        // Gaussian blur
+        case 15:
+        {
+            cout << "Gaussian blur selected" << endl;
+            double sigma = getValidNumber("Please enter sigma in pixels (e.g. 2.5): ");
+
+            string outputFilename = getValidBMPFilenameOutput();
+
+            if (cancellationCheck(outputFilename))
+            {
+                break;
+            }
+
+            bool written = renderOutput(session, outputFilename, [sigma](const vector<vector<Pixel>> &input)
+                                        { return process_gaussian_blur(input, sigma); });
+            if (written)
+            {
+                cout << "Successfully blurred! \n"
+                     << endl;
+            }
+            break;
+        }
+
+        // Unsharp mask
+        case 16:
+        {
+            cout << "Sharpen selected" << endl;
+            double sigma = getValidNumber("Please enter sigma in pixels (e.g. 1.5): ");
+            double amount = getValidNumber("Please enter amount (e.g. 0.8): ");
+
+            string outputFilename = getValidBMPFilenameOutput();
+
+            if (cancellationCheck(outputFilename))
+            {
+                break;
+            }
+
+            bool written = renderOutput(session, outputFilename, [sigma, amount](const vector<vector<Pixel>> &input)
+                                        { return process_unsharp_mask(input, sigma, amount); });
+            if (written)
+            {
+                cout << "Successfully sharpened! \n"
+                     << endl;
+            }
+            break;
+        }
+
+        // Resize
+        case 17:
+        {
+            cout << "Resize selected" << endl;
+            int new_width = 0;
+            int new_height = 0;
+            while (new_width < 1 || new_height < 1)
+            {
+                new_width = static_cast<int>(getValidNumber("Please enter new width in pixels: "));
+                new_height = static_cast<int>(getValidNumber("Please enter new height in pixels: "));
+            }
+            int filter = -1;
+            while (filter < RESAMPLE_BOX || filter > RESAMPLE_LANCZOS)
+            {
+                filter = static_cast<int>(getValidNumber("Please enter filter (0 = area average, 1 = bilinear, 2 = Lanczos): "));
+            }
+
+            string outputFilename = getValidBMPFilenameOutput();
+
+            if (cancellationCheck(outputFilename))
+            {
+                break;
+            }
+
+            bool written = renderOutput(session, outputFilename, [new_width, new_height, filter](const vector<vector<Pixel>> &input)
+                                        { return process_resize(input, new_width, new_height, static_cast<ResampleFilter>(filter)); });
+            if (written)
+            {
+                cout << "Successfully resized! \n"
+                     << endl;
+            }
+            break;
+        }
         // Default case - handels invalid integer inputs
         default:
             cout << "Invalid input. Please try again. \n"